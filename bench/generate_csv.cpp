@@ -0,0 +1,279 @@
+/**
+ *  Deterministic generator of large XY and WKT CSV files for benchmarks.
+ *  The same options and seed always give the same bytes: the values are
+ *  drawn from the raw output of std::mt19937_64, which is fully specified,
+ *  rather than from the standard distributions, which are not.
+ *
+ *  Usage: generate_csv [options] > file.csv
+ *    --mode xy|wkt           coordinate columns or a WKT column (Default: xy)
+ *    --rows N                number of rows (Default: 1000000)
+ *    --columns N             number of attribute columns (Default: 4)
+ *    --types LIST            types of the attribute columns, repeated in
+ *                            order, among int, int64, double and string
+ *                            (Default: int,double,string)
+ *    --geometry TYPE         point, linestring or polygon in WKT mode
+ *                            (Default: linestring)
+ *    --vertices N            vertices of a linestring or polygon (Default: 10)
+ *    --quote none|strings|all  quote no cell, the string cells or all cells;
+ *                            quoted strings contain the delimiter and
+ *                            escaped quotes (Default: none)
+ *    --delimiter C           (Default: ',' in XY mode, ';' in WKT mode)
+ *    --seed N                (Default: 1)
+ *    --no-header
+ */
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+enum Quote { QUOTE_NONE, QUOTE_STRINGS, QUOTE_ALL };
+
+struct Options {
+    bool wkt = false;
+    long long rows = 1000000;
+    int columns = 4;
+    std::vector<std::string> types = {"int", "double", "string"};
+    std::string geometry = "linestring";
+    int vertices = 10;
+    Quote quote = QUOTE_NONE;
+    char delimiter = 0;
+    unsigned long long seed = 1;
+    bool header = true;
+};
+
+static const char *const WORDS[] = {
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+    "india", "juliett", "kilo", "lima", "mike", "november", "oscar", "papa"
+};
+
+class Random {
+public:
+    explicit Random(unsigned long long seed): engine(seed) {};
+    // Uniform in [0, 1)
+    double uniform() {
+        return (engine() >> 11) * (1.0 / 9007199254740992.0);
+    };
+    double uniform(double min, double max) {
+        return min + (max - min) * uniform();
+    };
+    // Uniform in [0, n)
+    unsigned long long below(unsigned long long n) {
+        return engine() % n;
+    };
+private:
+    std::mt19937_64 engine;
+};
+
+static void usage() {
+    fprintf(stderr, "Usage: generate_csv [--mode xy|wkt] [--rows N] [--columns N] [--types LIST] "
+            "[--geometry point|linestring|polygon] [--vertices N] [--quote none|strings|all] "
+            "[--delimiter C] [--seed N] [--no-header]\n");
+    exit(EXIT_FAILURE);
+}
+
+static std::vector<std::string> split_list(const std::string &s) {
+    std::vector<std::string> items;
+    size_t begin = 0;
+    while (begin <= s.size()) {
+        size_t end = s.find(',', begin);
+        if (end == std::string::npos) end = s.size();
+        items.push_back(s.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    return items;
+}
+
+static Options parse_options(int argc, char **argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--no-header") {
+            options.header = false;
+            continue;
+        }
+        if (i + 1 >= argc) usage();
+        std::string value = argv[++i];
+        if (arg == "--mode" && (value == "xy" || value == "wkt")) {
+            options.wkt = value == "wkt";
+        } else if (arg == "--rows") {
+            options.rows = atoll(value.c_str());
+        } else if (arg == "--columns") {
+            options.columns = atoi(value.c_str());
+        } else if (arg == "--types") {
+            options.types = split_list(value);
+            for (size_t t = 0; t < options.types.size(); ++t) {
+                const std::string &type = options.types[t];
+                if (type != "int" && type != "int64" && type != "double" && type != "string") usage();
+            }
+        } else if (arg == "--geometry" && (value == "point" || value == "linestring" || value == "polygon")) {
+            options.geometry = value;
+        } else if (arg == "--vertices") {
+            options.vertices = atoi(value.c_str());
+        } else if (arg == "--quote" && value == "none") {
+            options.quote = QUOTE_NONE;
+        } else if (arg == "--quote" && value == "strings") {
+            options.quote = QUOTE_STRINGS;
+        } else if (arg == "--quote" && value == "all") {
+            options.quote = QUOTE_ALL;
+        } else if (arg == "--delimiter" && value.size() == 1) {
+            options.delimiter = value[0];
+        } else if (arg == "--seed") {
+            options.seed = strtoull(value.c_str(), NULL, 10);
+        } else {
+            usage();
+        }
+    }
+    if (options.rows < 0 || options.columns < 0 || options.vertices < 2) usage();
+    if (options.geometry == "polygon" && options.vertices < 3) usage();
+    if (options.delimiter == 0) options.delimiter = options.wkt ? ';' : ',';
+    return options;
+}
+
+static void append_number(std::string &line, const char *format, double value) {
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), format, value);
+    line.append(buf, len);
+}
+
+static void append_cell(std::string &line, const std::string &value, bool quoted) {
+    if (!quoted) {
+        line += value;
+        return;
+    }
+    line += '"';
+    for (size_t i = 0; i < value.size(); ++i) {
+        if (value[i] == '"') line += '"';
+        line += value[i];
+    }
+    line += '"';
+}
+
+/**
+ * A string of one to three words. When it is quoted, some values contain
+ * the delimiter or a quote to exercise the quoted cell handling.
+ */
+static std::string make_string(Random &random, const Options &options) {
+    std::string value = WORDS[random.below(16)];
+    int words = random.below(3);
+    for (int i = 0; i < words; ++i) {
+        value += ' ';
+        value += WORDS[random.below(16)];
+    }
+    if (options.quote != QUOTE_NONE) {
+        unsigned long long special = random.below(10);
+        if (special == 0) value += options.delimiter;
+        if (special == 1) value = "\"" + value + "\"";
+    }
+    return value;
+}
+
+/**
+ * Vertices around a center, as a random walk for a linestring or at
+ * increasing angles for a polygon, so that the ring does not intersect
+ * itself. The ring is closed by repeating the first vertex.
+ */
+static void append_wkt(std::string &line, Random &random, const Options &options) {
+    double cx = random.uniform(-180, 180);
+    double cy = random.uniform(-85, 85);
+    if (options.geometry == "point") {
+        line += "POINT (";
+        append_number(line, "%.6f", cx);
+        line += ' ';
+        append_number(line, "%.6f", cy);
+        line += ')';
+        return;
+    }
+    bool polygon = options.geometry == "polygon";
+    line += polygon ? "POLYGON ((" : "LINESTRING (";
+    int n = polygon ? options.vertices - 1 : options.vertices;
+    double x0 = 0, y0 = 0;
+    double x = cx, y = cy;
+    for (int i = 0; i < n; ++i) {
+        if (polygon) {
+            double angle = 2 * M_PI * (i + random.uniform()) / n;
+            double radius = random.uniform(0.001, 0.01);
+            x = cx + radius * cos(angle);
+            y = cy + radius * sin(angle);
+        } else if (i > 0) {
+            x += random.uniform(-0.001, 0.001);
+            y += random.uniform(-0.001, 0.001);
+        }
+        if (i == 0) {
+            x0 = x;
+            y0 = y;
+        } else {
+            line += ", ";
+        }
+        append_number(line, "%.6f", x);
+        line += ' ';
+        append_number(line, "%.6f", y);
+    }
+    if (polygon) {
+        line += ", ";
+        append_number(line, "%.6f", x0);
+        line += ' ';
+        append_number(line, "%.6f", y0);
+        line += ')';
+    }
+    line += ')';
+}
+
+int main(int argc, char **argv) {
+    Options options = parse_options(argc, argv);
+    Random random(options.seed);
+    bool quote_all = options.quote == QUOTE_ALL;
+    std::string line;
+    if (options.header) {
+        line = "id";
+        for (int c = 0; c < options.columns; ++c) {
+            line += options.delimiter;
+            append_cell(line, options.types[c % options.types.size()] + "_" + std::to_string(c), quote_all);
+        }
+        line += options.delimiter;
+        line += options.wkt ? "geom" : std::string("x") + options.delimiter + "y";
+        line += '\n';
+        fwrite(line.data(), 1, line.size(), stdout);
+    }
+    char buf[32];
+    for (long long r = 0; r < options.rows; ++r) {
+        line.clear();
+        snprintf(buf, sizeof(buf), "%lld", r + 1);
+        append_cell(line, buf, quote_all);
+        for (int c = 0; c < options.columns; ++c) {
+            const std::string &type = options.types[c % options.types.size()];
+            line += options.delimiter;
+            if (type == "string") {
+                append_cell(line, make_string(random, options), options.quote != QUOTE_NONE);
+                continue;
+            }
+            if (type == "int") {
+                snprintf(buf, sizeof(buf), "%d", static_cast<int>(random.below(2000000)) - 1000000);
+            } else if (type == "int64") {
+                snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(random.below(1ULL << 40)) + 10000000000LL);
+            } else {
+                snprintf(buf, sizeof(buf), "%.4f", random.uniform(-10000, 10000));
+            }
+            append_cell(line, buf, quote_all);
+        }
+        line += options.delimiter;
+        if (options.wkt) {
+            std::string geom;
+            append_wkt(geom, random, options);
+            // The WKT contains commas and is quoted when it is the delimiter
+            append_cell(line, geom, quote_all || options.delimiter == ',');
+        } else {
+            std::string x, y;
+            append_number(x, "%.6f", random.uniform(-180, 180));
+            append_number(y, "%.6f", random.uniform(-85, 85));
+            append_cell(line, x, quote_all);
+            line += options.delimiter;
+            append_cell(line, y, quote_all);
+        }
+        line += '\n';
+        fwrite(line.data(), 1, line.size(), stdout);
+    }
+    return 0;
+}
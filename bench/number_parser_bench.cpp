@@ -0,0 +1,102 @@
+/**
+ *  Micro-benchmark of NumberParser against the standard functions used
+ *  before, on coordinate and integer columns.
+ *
+ *  Usage: number_parser_bench [values]
+ */
+#include "../number_parser.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+struct Column {
+    std::string data; // values separated by '\n'
+    std::vector<size_t> offsets; // start of each value, plus the end
+};
+
+static Column make_column(size_t n, const char *format, double min, double max, unsigned seed) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> dist(min, max);
+    Column column;
+    char buf[64];
+    for (size_t i = 0; i < n; ++i) {
+        column.offsets.push_back(column.data.size());
+        int len = snprintf(buf, sizeof(buf), format, dist(rng));
+        column.data.append(buf, len);
+        column.data.push_back('\n');
+    }
+    column.offsets.push_back(column.data.size());
+    return column;
+}
+
+template <typename F>
+static void run(const char *name, const Column &column, F f) {
+    size_t n = column.offsets.size() - 1;
+    double checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < n; ++i) {
+        const char *begin = column.data.data() + column.offsets[i];
+        const char *end = column.data.data() + column.offsets[i + 1] - 1;
+        checksum += f(begin, end);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%-34s %8.1f ns/value %8.1f MB/s (checksum %g)\n", name, seconds * 1e9 / n,
+           column.data.size() / seconds / 1e6, checksum);
+}
+
+// Type detection as done by CSVReader::getStringType before NumberParser
+static int legacy_string_type(const std::string &s) {
+    if (s.empty() || ((!isdigit(s[0])) && (s[0] != '-') && (s[0] != '+'))) return 2;
+    char *iendptr;
+    char *dendptr;
+    strtol(s.c_str(), &iendptr, 10);
+    strtod(s.c_str(), &dendptr);
+    if (*iendptr != '\0' && *dendptr != '\0') return 2;
+    if (*iendptr != '\0' && *dendptr == '\0') return 1;
+    return 0;
+}
+
+static int number_type(const char *begin, const char *end) {
+    int64_t ivalue;
+    double dvalue;
+    if (NumberParser::parse_int64(begin, end, &ivalue) == NUMBER_OK) return 0;
+    if (NumberParser::parse_double(begin, end, &dvalue) == NUMBER_OK) return 1;
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    size_t n = argc > 1 ? atol(argv[1]) : 2000000;
+    Column lon = make_column(n, "%.6f", -180, 180, 1);
+    Column utm = make_column(n, "%.3f", 100000, 900000, 2);
+    Column ints = make_column(n, "%.0f", 1400000000, 1600000000, 3);
+    printf("%zu values per column\n", n);
+    printf("-- longitude (%%.6f)\n");
+    run("std::stod", lon, [](const char *b, const char *e) { return std::stod(std::string(b, e)); });
+    run("strtod", lon, [](const char *b, const char *) { return strtod(b, NULL); });
+    run("NumberParser::parse_double", lon, [](const char *b, const char *e) {
+        double v = 0;
+        NumberParser::parse_double(b, e, &v);
+        return v;
+    });
+    printf("-- projected coordinate (%%.3f)\n");
+    run("std::stod", utm, [](const char *b, const char *e) { return std::stod(std::string(b, e)); });
+    run("NumberParser::parse_double", utm, [](const char *b, const char *e) {
+        double v = 0;
+        NumberParser::parse_double(b, e, &v);
+        return v;
+    });
+    printf("-- integer (timestamp)\n");
+    run("std::stoi", ints, [](const char *b, const char *e) { return double(std::stoi(std::string(b, e))); });
+    run("NumberParser::parse_int64", ints, [](const char *b, const char *e) {
+        int64_t v = 0;
+        NumberParser::parse_int64(b, e, &v);
+        return double(v);
+    });
+    printf("-- type detection of coordinates\n");
+    run("strtol + strtod", lon, [](const char *b, const char *e) { return double(legacy_string_type(std::string(b, e))); });
+    run("parse_int64 + parse_double", lon, [](const char *b, const char *e) { return double(number_type(b, e)); });
+    return 0;
+}
@@ -0,0 +1,66 @@
+#!/bin/sh
+# Benchmark of csv2shp on generated XY and WKT files.
+#
+# Each conversion mode is run with --stats-json and the results are
+# gathered in one JSON file with the rows/s, MB/s, peak RSS and the time of
+# the stages of each run.
+#
+# Usage: run_bench.sh [output.json] (Default: BIN/bench_results.json)
+#   ROWS     rows of the XY file, the WKT file has ROWS / 10 (Default: 1000000)
+#   VERTICES vertices of the WKT linestrings (Default: 20)
+#   THREADS  threads of the parallel runs (Default: 4)
+#   BIN      directory of csv2shp and generate_csv (Default: bin)
+#   WORKDIR  directory of the generated and output files (Default: bin/bench)
+set -e
+BIN=${BIN:-bin}
+OUTPUT=${1:-$BIN/bench_results.json}
+ROWS=${ROWS:-1000000}
+VERTICES=${VERTICES:-20}
+THREADS=${THREADS:-4}
+WORKDIR=${WORKDIR:-$BIN/bench}
+mkdir -p "$WORKDIR"
+
+XY="$WORKDIR/xy_$ROWS.csv"
+WKT="$WORKDIR/wkt_$((ROWS / 10))_$VERTICES.csv"
+if [ ! -f "$XY" ]; then
+    "$BIN/generate_csv" --mode xy --rows "$ROWS" --columns 6 --types int,double,string > "$XY"
+fi
+if [ ! -f "$WKT" ]; then
+    "$BIN/generate_csv" --mode wkt --rows $((ROWS / 10)) --columns 6 --types int,double,string \
+        --geometry linestring --vertices "$VERTICES" > "$WKT"
+fi
+
+RUNS=""
+# run NAME ARGS...: convert with the given arguments and keep the statistics
+run() {
+    name=$1
+    shift
+    echo "Run $name" >&2
+    "$BIN/csv2shp" "$@" -o "$WORKDIR/$name.shp" --stats-json "$WORKDIR/$name.json" > /dev/null
+    RUNS="$RUNS $name"
+}
+run xy_gdal -i "$XY" -m xy -d , -w gdal
+run xy_native -i "$XY" -m xy -d , -w native
+run xy_native_threads -i "$XY" -m xy -d , -w native -j "$THREADS"
+run xy_native_scan_all -i "$XY" -m xy -d , -w native -s all
+run wkt_gdal -i "$WKT" -m wkt -w gdal
+run wkt_native -i "$WKT" -m wkt -w native
+run wkt_native_threads -i "$WKT" -m wkt -w native -j "$THREADS"
+
+{
+    echo "{"
+    echo "  \"format\": \"csv2shp-bench/1\","
+    echo "  \"rows\": $ROWS,"
+    echo "  \"vertices\": $VERTICES,"
+    echo "  \"threads\": $THREADS,"
+    echo "  \"runs\": ["
+    last=${RUNS##* }
+    for name in $RUNS; do
+        [ "$name" = "$last" ] && end="}" || end="},"
+        printf '    {"name": "%s", "stats": ' "$name"
+        sed -e '1!s/^/    /' -e "\$s/\$/$end/" "$WORKDIR/$name.json"
+    done
+    echo "  ]"
+    echo "}"
+} > "$OUTPUT"
+echo "Results written to $OUTPUT" >&2
@@ -8,11 +8,30 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <algorithm>
 #include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <strings.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <getopt.h>
+#include <sys/resource.h>
+#include "number_parser.hpp"
+#include "csv_scanner.hpp"
+#include "input_source.hpp"
+#include "stage_stats.hpp"
 
-typedef std::vector<std::string> CSVRow;
 std::vector<std::string> GEOM_TYPES = {"POINT", "LINESTRING", "POLYGON", "MULTIPOINT", "MULTILINESTRING", "MULTIPOLYGON"};
 struct CSVConfig {
     std::string input_file;
@@ -28,22 +47,60 @@ struct CSVConfig {
     bool xy = false;
     bool wkt = false;
     char delimiter = ';';
+    char quote = '"'; // quote character of the cells, 0 for none
+    int threads = 1;
+    bool native_writer = false;
+    long long scan_rows = 1; // rows used to infer column types, 0 for all
+    long long max_rows = 0; // rows of an output shard, 0 for no limit
+    long long max_bytes = 0; // size of the files of a shard, 0 for the format limit
+    bool spatial_index = false; // write a .qix quadtree with the output
+    bool sort_hilbert = false; // write the features along a Hilbert curve
+    bool stats = false; // print progress and the time of each stage on stderr
+    double progress_interval = 5; // seconds between progress lines
+    std::string stats_json; // file of the statistics of the run, empty for none
 };
 
+/**
+ * Type and size of the values of a column, found by scanning rows. Types
+ * are 0 for int, 3 for int64, 1 for double and 2 for string and only widen
+ * in that order. Empty cells are treated as null and ignored.
+ */
+struct ColumnStats {
+    int type = -1; // -1 until a non empty value is found
+    int width = 0; // maximum length in bytes
+    int int_digits = 0; // maximum length of the integer part, including sign
+    int decimals = 0; // maximum number of digits after the decimal point
+    bool exponent = false; // a number is written with an exponent
+    void merge(const ColumnStats &other) {
+        type = widen_type(type, other.type);
+        width = std::max(width, other.width);
+        int_digits = std::max(int_digits, other.int_digits);
+        decimals = std::max(decimals, other.decimals);
+        exponent = exponent || other.exponent;
+    };
+    static int widen_type(int a, int b) {
+        // Rank of the types -1, int, double, string and int64
+        static const int rank[5] = {-1, 0, 2, 3, 1};
+        return rank[a + 1] >= rank[b + 1] ? a : b;
+    };
+};
 
 class CSVReader {
 public:
-    CSVReader(CSVConfig &conf): ifs(conf.input_file)
+    CSVReader(CSVConfig &conf)
     {
-        //std::cout<<"Reading meta data from: " << filename << std::endl;
+        //std::cerr<<"Reading meta data from: " << filename << std::endl;
         delimiter = conf.delimiter;
+        scanner = CSVScanner(conf.delimiter, conf.quote);
+        has_header = conf.hasHeader;
+        open_input(conf.input_file);
         if (conf.mode_xy) {
             geom_type_idx = 0; // XY with Point data type
             if (conf.hasHeader) {
-                headers = getNextLineAndSplitIntoTokens();
+                headers = to_strings(getNextLineAndSplitIntoTokens());
                 int num_cols = headers.size();
-                std::cout << "Columns count: " << num_cols << std::endl;
-                std::vector<std::string> row = getNextLineAndSplitIntoTokens();
+                std::cerr << "Columns count: " << num_cols << std::endl;
+                const CSVRow &row = getNextLineAndSplitIntoTokens();
                 for (int i = 0; i < headers.size(); ++i) {
                     if (headers[i] == conf.x_column) x_idx = i;
                     if (headers[i] == conf.y_column) y_idx = i;
@@ -54,23 +111,22 @@ public:
                     y_idx = std::stoi(conf.y_column);
                 // Check if int is specified or not
                 if ((x_idx > -1 && x_idx < num_cols) && (y_idx > -1 && y_idx < num_cols)) {
-                    std::cout << "X column idx: " << x_idx << std::endl;
-                    std::cout << "Y column idx: " << y_idx << std::endl;
+                    std::cerr << "X column idx: " << x_idx << std::endl;
+                    std::cerr << "Y column idx: " << y_idx << std::endl;
                 } else {
-                    std::cout << "--- Error, x,y column not found" << std::endl;
-                    std::cout << "Program stops unexpectedly" << std::endl;
+                    std::cerr << "--- Error, x,y column not found" << std::endl;
+                    std::cerr << "Program stops unexpectedly" << std::endl;
                     exit(EXIT_FAILURE);
                 }
                 column_types = find_data_types(row);
                 // Reset header of the CSV file
-                ifs.clear();
-                ifs.seekg(0, std::ios::beg);
+                rewind();
                 getNextLineAndSplitIntoTokens(); // skip header
             } else {
                 // Construct header and infer column type
-                std::vector<std::string> row = getNextLineAndSplitIntoTokens();
+                const CSVRow &row = getNextLineAndSplitIntoTokens();
                 int num_cols = row.size();
-                std::cout << "Columns count: " << num_cols << std::endl;
+                std::cerr << "Columns count: " << num_cols << std::endl;
                 headers = get_default_headers(row.size());
                 // Check if int is specified or not
                 if (getStringType(conf.x_column)==0) 
@@ -78,22 +134,21 @@ public:
                 if (getStringType(conf.y_column)==0) 
                     y_idx = std::stoi(conf.y_column);
                 if (x_idx < 0 || x_idx >= num_cols || y_idx < 0 || y_idx >= num_cols) {
-                    std::cout << "--- Error, x,y column not found" << std::endl;
-                    std::cout << "Program stops unexpectedly" << std::endl;
+                    std::cerr << "--- Error, x,y column not found" << std::endl;
+                    std::cerr << "Program stops unexpectedly" << std::endl;
                     exit(EXIT_FAILURE);
                 }
                 column_types = find_data_types(row);
                 // Reset header of the CSV file
-                ifs.clear();
-                ifs.seekg(0, std::ios::beg);
+                rewind();
             }
         } else {
             // wkt geom
             if (conf.hasHeader) {
-                headers = getNextLineAndSplitIntoTokens();
+                headers = to_strings(getNextLineAndSplitIntoTokens());
                 int num_cols = headers.size();
-                std::cout << "Columns count: " << num_cols << std::endl;
-                std::vector<std::string> row = getNextLineAndSplitIntoTokens();
+                std::cerr << "Columns count: " << num_cols << std::endl;
+                const CSVRow &row = getNextLineAndSplitIntoTokens();
                 for (int i = 0; i < headers.size(); ++i) {
                     if (headers[i] == conf.geom_column) geom_idx = i;
                 }
@@ -101,13 +156,13 @@ public:
                     geom_idx = std::stoi(conf.geom_column);
                 // Check if int is specified or not
                 if (geom_idx > -1) {
-                    std::cout << "Geometry column index " << geom_idx << std::endl;
+                    std::cerr << "Geometry column index " << geom_idx << std::endl;
                 } else {
-                    std::cout << "--- Error, geometry column not found" << std::endl;
-                    std::cout << "Program stops unexpectedly" << std::endl;
+                    std::cerr << "--- Error, geometry column not found" << std::endl;
+                    std::cerr << "Program stops unexpectedly" << std::endl;
                     exit(EXIT_FAILURE);
                 }
-                std::string wkt = row[geom_idx];
+                std::string wkt = row[geom_idx].str();
                 std::stringstream  wktStream(wkt);
                 // Get geometry type from wkt
                 // POINT, LINESTRING, POLYGON, MULTILINESTRING, MULTIPOLYGON
@@ -117,32 +172,31 @@ public:
                     if (wktType == GEOM_TYPES[i]) geom_type_idx = i;
                 }
                 if (geom_type_idx > -1) {
-                    std::cout << "Geometry type " << GEOM_TYPES[geom_type_idx] << std::endl;
+                    std::cerr << "Geometry type " << GEOM_TYPES[geom_type_idx] << std::endl;
                 } else {
-                    std::cout << "--- Error, unrecognized geometry type: " << wktType << std::endl;
-                    std::cout << "Program stops unexpectedly" << std::endl;
+                    std::cerr << "--- Error, unrecognized geometry type: " << wktType << std::endl;
+                    std::cerr << "Program stops unexpectedly" << std::endl;
                     exit(EXIT_FAILURE);
                 }
                 column_types = find_data_types(row);
                 // Reset header of the CSV file
-                ifs.clear();
-                ifs.seekg(0, std::ios::beg);
+                rewind();
                 getNextLineAndSplitIntoTokens(); // skip header
             } else {
-                std::vector<std::string> row = getNextLineAndSplitIntoTokens();
+                const CSVRow &row = getNextLineAndSplitIntoTokens();
                 int num_cols = row.size();
-                std::cout << "Columns count: " << num_cols << std::endl;
+                std::cerr << "Columns count: " << num_cols << std::endl;
                 headers = get_default_headers(row.size());
                 if (getStringType(conf.geom_column)==0) 
                     geom_idx = std::stoi(conf.geom_column);
                 if (geom_idx > -1 && geom_idx < num_cols) {
-                    std::cout << "Geometry column index " << geom_idx << std::endl;
+                    std::cerr << "Geometry column index " << geom_idx << std::endl;
                 } else {
-                    std::cout << "--- Error, geometry column not found" << std::endl;
-                    std::cout << "Program stops unexpectedly" << std::endl;
+                    std::cerr << "--- Error, geometry column not found" << std::endl;
+                    std::cerr << "Program stops unexpectedly" << std::endl;
                     exit(EXIT_FAILURE);
                 }
-                std::string wkt = row[geom_idx];
+                std::string wkt = row[geom_idx].str();
                 std::stringstream  wktStream(wkt);
                 // Get geometry type from wkt
                 // POINT, LINESTRING, POLYGON, MULTILINESTRING, MULTIPOLYGON
@@ -152,36 +206,119 @@ public:
                     if (wktType == GEOM_TYPES[i]) geom_type_idx = i;
                 }
                 if (geom_type_idx > -1) {
-                    std::cout << "Geometry type " << GEOM_TYPES[geom_type_idx] << std::endl;
+                    std::cerr << "Geometry type " << GEOM_TYPES[geom_type_idx] << std::endl;
                 } else {
-                    std::cout << "--- Error, unrecognized geometry type: " << wktType << std::endl;
-                    std::cout << "Program stops unexpectedly" << std::endl;
+                    std::cerr << "--- Error, unrecognized geometry type: " << wktType << std::endl;
+                    std::cerr << "Program stops unexpectedly" << std::endl;
                     exit(EXIT_FAILURE);
                 }
                 column_types = find_data_types(row);
                 // Reset header of the CSV file
-                ifs.clear();
-                ifs.seekg(0, std::ios::beg);
+                rewind();
             }
         }
-        std::cout << "Finish reading meta data" << std::endl;
+        // Columns missing from the first row, or a file without data rows
+        if (column_types.size() < headers.size()) column_types.resize(headers.size(), 2);
+        if (conf.scan_rows != 1) {
+            scan_column_stats(conf.scan_rows, conf.threads);
+        }
+        // The rows read from now on are not replayed
+        replay = false;
+        std::cerr << "Finish reading meta data" << std::endl;
+    };
+    ~CSVReader() {
+        close_input();
+    };
+    /**
+     * Read the next line and split it into cells. The returned row is reused
+     * by the reader and the cells point into its buffer, so both are only
+     * valid until the next call.
+     */
+    const CSVRow &getNextLineAndSplitIntoTokens()
+    {
+        const char *line_begin;
+        const char *line_end;
+        NoTimer timer(NULL);
+        row_buffer.clear();
+        next_row(row_buffer, &line_begin, &line_end, timer);
+        return row_buffer;
     };
-    std::vector<std::string> getNextLineAndSplitIntoTokens()
+    /**
+     * Read the next line and split it into cells appended to row. The
+     * lines of a mapped input are found while splitting them, in one pass,
+     * and their time is counted as splitting.
+     * @return false if there is no more line
+     */
+    template <class Timer>
+    bool next_row(CSVRow &row, const char **line_begin, const char **line_end, Timer &timer)
     {
-        std::vector<std::string>   result;
-        std::string                line;
-        // extracts characters until the given character is found
-        std::getline(ifs, line);
-        std::stringstream          lineStream(line);
-        std::string                cell;
-        while (std::getline(lineStream, cell, delimiter)) // Get token from stringstream into string
-        {
-            result.push_back(cell);
+        if (mapped) {
+            if (!cursor.next_row(row, line_begin, line_end)) return false;
+            pos = cursor.position();
+        } else {
+            if (!next_line(line_begin, line_end)) return false;
+            timer.lap(STAGE_READ);
+            scanner.split_line(*line_begin, *line_end, row);
         }
-        return result;
+        timer.lap(STAGE_SPLIT);
+        ++rows_read;
+        return true;
+    };
+    /**
+     * Get the unread part of a mapped input, which can be split and
+     * processed in parallel.
+     * @return false if the input is not mapped
+     */
+    bool get_remaining_range(const char **begin, const char **end) {
+        if (!mapped) return false;
+        *begin = pos;
+        *end = map_end;
+        return true;
+    };
+    char get_delimiter() {
+        return delimiter;
+    };
+    const CSVScanner &get_scanner() {
+        return scanner;
+    };
+    /**
+     * Size of the input, or the decompressed bytes read so far for a stream
+     */
+    long long get_input_bytes() {
+        return mapped ? map_size : bytes_read;
+    };
+    /**
+     * Progress of the sequential reading, for progress reports
+     * @param bytes set to the number of input bytes read
+     * @return fraction of the input read, from the position in the file
+     * for a compressed file, negative if the size is unknown
+     */
+    double get_progress(long long *bytes) {
+        if (mapped) {
+            *bytes = pos - map_begin;
+            return map_size > 0 ? static_cast<double>(*bytes) / map_size : 1;
+        }
+        *bytes = bytes_read - (buf_end - pos);
+        if (file_size <= 0) return -1;
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        return offset < 0 ? -1 : static_cast<double>(offset) / file_size;
+    };
+    /**
+     * Get the row number (starting from 1, including the header) of a
+     * position in the last row read or, for a mapped input, anywhere in the
+     * file. Only used for error messages.
+     */
+    long long locate_row(const char *ptr) {
+        if (!mapped) return rows_read;
+        long long row = 1;
+        for (const char *p = map_begin; p < ptr; ++p) {
+            if (*p == '\n') ++row;
+        }
+        return row;
     };
     bool hasNextLine() {
-        return ifs.peek() != EOF;
+        if (mapped) return pos < map_end;
+        return pos < buf_end || fill_buffer() > 0;
     };
     int get_x_idx() {
         return x_idx;
@@ -201,15 +338,177 @@ public:
     std::vector<int> get_column_types() {
         return column_types;
     };
+    /**
+     * Statistics of the columns, empty if only the first row is used to
+     * infer the types.
+     */
+    std::vector<ColumnStats> get_column_stats() {
+        return column_stats;
+    };
 private:
-    static std::vector<int> find_data_types(CSVRow &row) {
+    static std::vector<int> find_data_types(const CSVRow &row) {
         // String 0, int 1, double 2
         std::vector<int> result;
         for (int i = 0; i < row.size(); ++i) {
-            result.push_back(getStringType(row[i]));
+            result.push_back(getCellType(row[i]));
         };
         return result;
     };
+    static std::vector<std::string> to_strings(const CSVRow &row) {
+        std::vector<std::string> result;
+        for (int i = 0; i < row.size(); ++i) {
+            result.push_back(row[i].str());
+        }
+        return result;
+    };
+    /**
+     * Open the input file, - for the standard input. A regular file is
+     * memory mapped if possible. Pipes and compressed files are read as a
+     * stream through a buffer, with the decompression on its own thread.
+     */
+    void open_input(const std::string &filename) {
+        fd = filename == "-" ? STDIN_FILENO : ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "--- Error, cannot open input file " << filename << std::endl;
+            std::cerr << "Program stops unexpectedly" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        // The first bytes tell the compression, they are read again by the source
+        std::string magic;
+        struct stat st;
+        bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+        if (regular) {
+            char head[4];
+            ssize_t n = pread(fd, head, sizeof(head), 0);
+            if (n > 0) magic.assign(head, n);
+        } else {
+            char head[4];
+            ssize_t n;
+            while (magic.size() < sizeof(head) &&
+                   ((n = ::read(fd, head, sizeof(head) - magic.size())) > 0 || (n < 0 && errno == EINTR))) {
+                if (n > 0) magic.append(head, n);
+            }
+        }
+        InputCompression compression = detect_compression(magic.data(), magic.size());
+        if (regular) file_size = st.st_size;
+        if (regular && compression == INPUT_PLAIN) {
+            map_size = st.st_size;
+            if (map_size == 0) {
+                mapped = true;
+                map_begin = map_end = pos = NULL;
+                cursor = CSVScanner::Cursor(&scanner, pos, map_end);
+                return;
+            }
+            void *addr = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                madvise(addr, map_size, MADV_SEQUENTIAL);
+                mapped = true;
+                map_begin = pos = static_cast<const char *>(addr);
+                map_end = map_begin + map_size;
+                cursor = CSVScanner::Cursor(&scanner, pos, map_end);
+                return;
+            }
+        }
+        // Buffered reading, the bytes of a regular file are all read by the source
+        mapped = false;
+        if (regular) lseek(fd, magic.size(), SEEK_SET);
+        source = new FileSource(fd, magic);
+        if (compression == INPUT_GZIP) {
+            source = new ThreadedSource(new GzipSource(source));
+        } else if (compression == INPUT_ZSTD) {
+#ifdef CSV2SHP_WITH_ZSTD
+            source = new ThreadedSource(new ZstdSource(source));
+#else
+            std::cerr << "--- Error, zstd input is not supported by this build (make ZSTD=1)" << std::endl;
+            std::cerr << "Program stops unexpectedly" << std::endl;
+            exit(EXIT_FAILURE);
+#endif
+        }
+        buffer.resize(1 << 20);
+        pos = buf_end = buffer.data();
+    };
+    void close_input() {
+        if (mapped && map_begin != NULL) munmap(const_cast<char *>(map_begin), map_size);
+        delete source;
+        source = NULL;
+        if (fd > STDIN_FILENO) ::close(fd);
+        fd = -1;
+    };
+    /**
+     * Move back to the beginning of the input. A stream cannot be rewound,
+     * so the data read while replay is set is kept in the buffer and read
+     * again.
+     */
+    void rewind() {
+        rows_read = 0;
+        if (mapped) {
+            pos = map_begin;
+            cursor = CSVScanner::Cursor(&scanner, pos, map_end);
+        } else {
+            pos = buffer.data();
+        }
+    };
+    /**
+     * Read more data into the buffer. The consumed part is dropped unless
+     * it has to be replayed, and the buffer grows when it is full.
+     * @return number of bytes read
+     */
+    size_t fill_buffer() {
+        if (eof) return 0;
+        size_t consumed = replay ? 0 : pos - buffer.data();
+        size_t remaining = buf_end - buffer.data() - consumed;
+        size_t offset = pos - buffer.data() - consumed;
+        if (consumed > 0) {
+            memmove(buffer.data(), buffer.data() + consumed, remaining);
+        } else if (remaining == buffer.size()) {
+            buffer.resize(buffer.size() * 2);
+        }
+        pos = buffer.data() + offset;
+        buf_end = buffer.data() + remaining;
+        ssize_t n = source->read(buffer.data() + remaining, buffer.size() - remaining);
+        if (n < 0) {
+            std::cerr << "--- Error, cannot read input: " << source->get_error() << std::endl;
+            std::cerr << "Program stops unexpectedly" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0) {
+            eof = true;
+            return 0;
+        }
+        buf_end += n;
+        bytes_read += n;
+        return n;
+    };
+    /**
+     * Get the range of the next line excluding the line break.
+     * @return false if there is no more line
+     */
+    bool next_line(const char **line_begin, const char **line_end) {
+        if (mapped) {
+            if (!cursor.next_line(line_begin, line_end)) return false;
+            pos = cursor.position();
+            return true;
+        }
+        // The search goes on after a refill with the quote state at the end
+        size_t scanned = 0;
+        bool in_quote = false;
+        while (true) {
+            const char *nl = scanner.find_line_break(pos + scanned, buf_end, &in_quote);
+            if (nl != NULL) {
+                *line_begin = pos;
+                *line_end = CSVScanner::trim_cr(pos, nl);
+                pos = nl + 1;
+                return true;
+            }
+            scanned = buf_end - pos;
+            if (fill_buffer() == 0) break;
+        }
+        if (pos >= buf_end) return false;
+        *line_begin = pos;
+        *line_end = buf_end;
+        pos = buf_end;
+        return true;
+    };
     static std::vector<std::string> get_default_headers(int n) {
         std::vector<std::string> headers(n);
         for (int i = 0; i < n; ++i) {
@@ -218,247 +517,2714 @@ private:
         return headers;
     };
     /**
-     * Get type of string, 0 for int, 1 for double and 2 for string
+     * Get type of string, 0 for int, 1 for double, 2 for string and 3 for
+     * int that does not fit in 32 bits
      * @param  s [description]
      * @return   [description]
      */
     static int getStringType(const std::string & s) {
-        if (s.empty() || ((!isdigit(s[0])) && (s[0] != '-') && (s[0] != '+'))) return 2;
-        char* iendptr;
-        char* dendptr;
-        long ivalue = strtol(s.c_str(), &iendptr, 10);
-        double dval = strtod(s.c_str(), &dendptr);
-        if (*iendptr != '\0' && *dendptr != '\0') {
-            // Input string
-            return 2;
-        } else if (*iendptr != '\0' && *dendptr == '\0') {
+        return getCellType(CSVCell{s.data(), s.size()});
+    };
+    static int getCellType(const CSVCell &cell) {
+        if (cell.empty() || ((!isdigit(cell.data[0])) && (cell.data[0] != '-') && (cell.data[0] != '+'))) return 2;
+        int64_t ivalue;
+        double dvalue;
+        NumberStatus status = NumberParser::parse_int64(cell.data, cell.data + cell.size, &ivalue);
+        if (status == NUMBER_OK) {
+            // Input is integer or int64
+            return (ivalue > INT32_MAX || ivalue < INT32_MIN) ? 3 : 0;
+        } else if (NumberParser::parse_double(cell.data, cell.data + cell.size, &dvalue) == NUMBER_OK) {
             // Input is double
             return 1;
         } else {
-            // Input is integer
-            return 0;
+            // Input string
+            return 2;
+        }
+    };
+    /**
+     * Add a cell to the statistics of its column
+     */
+    static void add_to_stats(const CSVCell &cell, ColumnStats &stats) {
+        if (cell.empty()) return;
+        int type = getCellType(cell);
+        stats.type = ColumnStats::widen_type(stats.type, type);
+        stats.width = std::max<int>(stats.width, cell.size);
+        if (type == 2) return;
+        const char *point = static_cast<const char *>(memchr(cell.data, '.', cell.size));
+        const char *exp = NULL;
+        for (size_t i = 0; i < cell.size; ++i) {
+            if (cell.data[i] == 'e' || cell.data[i] == 'E') exp = cell.data + i;
+        }
+        if (exp != NULL) stats.exponent = true;
+        const char *int_end = point != NULL ? point : (exp != NULL ? exp : cell.data + cell.size);
+        stats.int_digits = std::max<int>(stats.int_digits, int_end - cell.data);
+        if (point != NULL) {
+            const char *dec_end = exp != NULL ? exp : cell.data + cell.size;
+            stats.decimals = std::max<int>(stats.decimals, dec_end - point - 1);
+        }
+    };
+    /**
+     * Add the rows in a range of the input to the statistics
+     */
+    void scan_range(const char *begin, const char *end, long long max_rows, std::vector<ColumnStats> &stats) {
+        CSVScanner::Cursor range(&scanner, begin, end);
+        CSVRow row;
+        const char *line_begin;
+        const char *line_end;
+        long long rows = 0;
+        while (max_rows == 0 || rows < max_rows) {
+            row.clear();
+            if (!range.next_row(row, &line_begin, &line_end)) break;
+            for (size_t i = 0; i < row.size() && i < stats.size(); ++i) {
+                add_to_stats(row[i], stats[i]);
+            }
+            ++rows;
+        }
+    };
+    /**
+     * Infer the column types and field sizes from max_rows data rows, or all
+     * rows if max_rows is 0. A whole mapped file is scanned in parallel.
+     */
+    void scan_column_stats(long long max_rows, int threads) {
+        column_stats = std::vector<ColumnStats>(headers.size());
+        const char *begin;
+        const char *end;
+        if (get_remaining_range(&begin, &end)) {
+            if (max_rows == 0 && threads > 1) {
+                std::vector<std::pair<const char *, const char *> > chunks = scanner.split_range(begin, end, 4 << 20);
+                std::vector<std::vector<ColumnStats> > results(chunks.size(), column_stats);
+                std::vector<std::thread> workers;
+                size_t next_chunk = 0;
+                std::mutex mutex;
+                for (int t = 0; t < threads; ++t) {
+                    workers.push_back(std::thread([&]() {
+                        while (true) {
+                            size_t idx;
+                            {
+                                std::lock_guard<std::mutex> lock(mutex);
+                                idx = next_chunk++;
+                            }
+                            if (idx >= chunks.size()) return;
+                            scan_range(chunks[idx].first, chunks[idx].second, 0, results[idx]);
+                        }
+                    }));
+                }
+                for (size_t t = 0; t < workers.size(); ++t) workers[t].join();
+                for (size_t idx = 0; idx < results.size(); ++idx) {
+                    for (size_t i = 0; i < column_stats.size(); ++i) column_stats[i].merge(results[idx][i]);
+                }
+            } else {
+                scan_range(begin, end, max_rows, column_stats);
+            }
+        } else {
+            // Read the rows through the buffer, they are kept there and
+            // replayed from the first row. With all rows a stream is held
+            // in memory as a whole.
+            long long rows = 0;
+            while ((max_rows == 0 || rows < max_rows) && hasNextLine()) {
+                const CSVRow &row = getNextLineAndSplitIntoTokens();
+                for (size_t i = 0; i < row.size() && i < column_stats.size(); ++i) {
+                    add_to_stats(row[i], column_stats[i]);
+                }
+                ++rows;
+            }
+            rewind();
+            if (has_header) getNextLineAndSplitIntoTokens();
         }
+        for (size_t i = 0; i < column_stats.size(); ++i) {
+            // A column without any value is written as string
+            column_types[i] = column_stats[i].type < 0 ? 2 : column_stats[i].type;
+        }
+        std::cerr << "Column types inferred from " << (max_rows == 0 ? std::string("all") : std::to_string(max_rows)) << " rows" << std::endl;
     };
     /**
      *  Infer geometry type of the CSV file
      */
     std::vector<std::string> headers; // headers of CSV file
     std::vector<int> column_types; // headers of CSV file
-    std::fstream ifs;
+    std::vector<ColumnStats> column_stats;
+    bool has_header = true;
+    int fd = -1;
+    InputSource *source = NULL; // used when the input is not mapped
+    bool replay = true; // keep the rows read while inferring the types
+    bool mapped = false;
+    bool eof = false;
+    size_t map_size = 0;
+    const char *map_begin = NULL;
+    const char *map_end = NULL;
+    const char *pos = NULL; // current position in the mapping or buffer
+    const char *buf_end = NULL; // end of valid data in buffer
+    std::vector<char> buffer; // used when the input is not mapped
+    CSVScanner scanner;
+    CSVScanner::Cursor cursor; // reads a mapped input from pos
+    CSVRow row_buffer; // cells of the last row read
+    long long rows_read = 0;
+    long long bytes_read = 0; // bytes read from the source of a stream
+    long long file_size = 0; // size of a regular input file, compressed or not
     char delimiter = ','; // delimiter
     int x_idx = -1; // x column idx
     int y_idx = -1; // y column idx
     int geom_idx = -1; // geom column idx
     int geom_type_idx = -1; // 0 for point, 1 for linestring and 2 for polygon
 };
-class SHPWriter {
+/**
+ * Coordinates of a geometry flattened into parts, which is the layout used
+ * by shapefile records.
+ */
+struct FlatGeometry {
+    int shape_type = 0; // shapefile shape type, 0 for a null shape
+    int geom_type_idx = -1; // index in GEOM_TYPES
+    std::vector<double> xy; // x0,y0,x1,y1,...
+    std::vector<int> parts; // index of the first point of each part
+    std::vector<char> outer; // for polygons, 1 if the part is an exterior ring
+    void clear() {
+        shape_type = 0;
+        geom_type_idx = -1;
+        xy.clear();
+        parts.clear();
+        outer.clear();
+    };
+    int num_points() const {
+        return xy.size() / 2;
+    };
+    void start_part(bool is_outer) {
+        parts.push_back(num_points());
+        outer.push_back(is_outer);
+    };
+    void add_point(double x, double y) {
+        xy.push_back(x);
+        xy.push_back(y);
+    };
+};
+
+/**
+ * Parser of the WKT geometries in GEOM_TYPES. Coordinates are decoded in a
+ * single pass into a FlatGeometry, which is reused between rows so that no
+ * allocation happens per vertex. Z and M values are read and dropped.
+ */
+class WKTParser {
 public:
-    // void (*FunctionPointers[3])(OGRFeature *feature, int idx, std::string &content) = {feature_set_int_field,feature_set_double_field,feature_set_string_field};
-    SHPWriter(CSVConfig &_conf, CSVReader &reader): conf(_conf) {
-        std::string output_file = conf.output_file;
-        std::vector<std::string> headers = reader.get_headers();
-        x_idx = reader.get_x_idx();
-        y_idx = reader.get_y_idx();
-        geom_idx = reader.get_geom_idx();
-        csv_column_types = reader.get_column_types();
-        int geom_type_idx = reader.get_geom_type_idx();
-        const char *pszDriverName = "ESRI Shapefile";
-        GDALDriver *poDriver;
-        GDALAllRegister();
-        poDriver = GetGDALDriverManager()->GetDriverByName(pszDriverName );
-        if ( poDriver == NULL )
-        {
-            printf( "%s driver not available.\n", pszDriverName );
-            std::cout << "Program stops unexpectedly" << std::endl;
-            exit( 1 );
+    /**
+     * Parse a WKT string
+     * @return false if the WKT is malformed, see get_error and
+     * get_error_offset
+     */
+    bool parse(const char *_begin, const char *_end, FlatGeometry &geom) {
+        begin = p = _begin;
+        end = _end;
+        error = NULL;
+        geom.clear();
+        skip_spaces();
+        const char *word = p;
+        while (p < end && isalpha(static_cast<unsigned char>(*p))) ++p;
+        int type_idx = -1;
+        for (int i = 0; i < GEOM_TYPES.size(); ++i) {
+            if (GEOM_TYPES[i].size() == p - word
+                    && strncasecmp(GEOM_TYPES[i].c_str(), word, p - word) == 0) {
+                type_idx = i;
+            }
         }
-        poDS = poDriver->Create(output_file.c_str(), 0, 0, 0, GDT_Unknown, NULL );
-        if ( poDS == NULL )
-        {
-            printf( "Creation of output file failed.\n" );
-            std::cout << "Program stops unexpectedly" << std::endl;
-            exit( 1 );
+        if (type_idx < 0) {
+            p = word;
+            return fail("unknown geometry type");
         }
-        poLayer = poDS->CreateLayer("layer", NULL, ogrtypes[geom_type_idx], NULL ); // To update this one
-        if ( poLayer == NULL )
-        {
-            printf( "Layer creation failed.\n" );
-            std::cout << "Program stops unexpectedly" << std::endl;
-            exit( 1 );
+        geom.geom_type_idx = type_idx;
+        if (!parse_dimension()) return false;
+        if (parse_empty()) return finish();
+        geom.shape_type = shape_types[type_idx];
+        bool ok;
+        switch (type_idx) {
+        case 0:
+            ok = expect('(') && parse_coordinate(geom) && expect(')');
+            break;
+        case 1:
+            ok = parse_points(geom, false);
+            break;
+        case 2:
+            ok = parse_polygon(geom);
+            break;
+        case 3:
+            ok = parse_multipoint(geom);
+            break;
+        case 4:
+            ok = parse_list(geom, &WKTParser::parse_linestring);
+            break;
+        default:
+            ok = parse_list(geom, &WKTParser::parse_polygon);
+            break;
         }
-        csv_field_indices = std::vector<int>(headers.size());
-        int temp = 0;
-        for (int i = 0; i < headers.size(); ++i) {
-            // Define fields
-            if ((!conf.mode_xy && i == geom_idx) || (conf.mode_xy && i == x_idx)
-                    || (conf.mode_xy && i == y_idx)) {
-                csv_field_indices[i] = -1;
-                continue;
-            }
-            if (csv_column_types[i] == 0) {
-                // int
-                OGRFieldDefn oField(headers[i].c_str(), OFTInteger);
-                csv_field_indices[i] = temp;
-                temp++;
-                if (poLayer->CreateField( &oField ) != OGRERR_NONE )
-                {
-                    printf("Creating int field %s failed.\n", headers[i].c_str());
-                    std::cout << "Program stops unexpectedly" << std::endl;
-                    exit( 1 );
-                }
-            } else if (csv_column_types[i] == 1) {
-                // Double
-                OGRFieldDefn oField(headers[i].c_str(), OFTReal);
-                csv_field_indices[i] = temp;
-                temp++;
-                if ( poLayer->CreateField( &oField ) != OGRERR_NONE )
-                {
-                    printf("Creating double field %s failed.\n", headers[i].c_str());
-                    std::cout << "Program stops unexpectedly" << std::endl;
-                    exit( 1 );
-                }
-            } else { // string
-                OGRFieldDefn oField(headers[i].c_str(), OFTString);
-                csv_field_indices[i] = temp;
-                temp++;
-                oField.SetWidth(100);
-                if ( poLayer->CreateField( &oField ) != OGRERR_NONE )
-                {
-                    printf("Creating string field %s failed.\n", headers[i].c_str());
-                    std::cout << "Program stops unexpectedly" << std::endl;
-                    exit( 1 );
-                }
-            }
+        return ok && finish();
+    };
+    const char *get_error() const {
+        return error;
+    };
+    /**
+     * Offset of the error from the start of the WKT string
+     */
+    size_t get_error_offset() const {
+        return p - begin;
+    };
+private:
+    typedef bool (WKTParser::*ElementParser)(FlatGeometry &geom);
+    bool fail(const char *message) {
+        if (error == NULL) error = message;
+        return false;
+    };
+    void skip_spaces() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) ++p;
+    };
+    bool expect(char c) {
+        skip_spaces();
+        if (p < end && *p == c) {
+            ++p;
+            return true;
         }
-        printf("Fields count excluding geometry %d.\n", temp);
+        if (c == '(') return fail("expected '('");
+        if (c == ')') return fail("expected ')' or ','");
+        return fail("unexpected character");
     };
-    void write_data(CSVRow &row) {
-        if (conf.mode_xy) {
-            // XY format
-            OGRFeature *poFeature;
-            poFeature = OGRFeature::CreateFeature(poLayer->GetLayerDefn());
-            double x, y;
-            for (int i = 0; i < row.size(); ++i) {
-                if (i != x_idx && i != y_idx)
-                    funcArray[csv_column_types[i]](poFeature, csv_field_indices[i], row[i]);
-                // funcArray[column_types[i]](poFeature, headers[i], row[i]);
-                if (i == x_idx) x = std::stod(row[i]);
-                if (i == y_idx) y = std::stod(row[i]);
-            }
-            OGRPoint pt;
-            pt.setX( x );
-            pt.setY( y );
-            // When the geometry is created from OGRGeometryFactory, the SetGeometryDirectly should be used.
-            poFeature->SetGeometry(&pt);
-            if ( poLayer->CreateFeature( poFeature ) != OGRERR_NONE )
-            {
-                printf( "Failed to create feature in shapefile.\n");
-                std::cout << "Program stops unexpectedly" << std::endl;
-                exit( 1 );
-            }
-            OGRFeature::DestroyFeature(poFeature);
-        } else {
-            // WKT format
-            OGRFeature *poFeature;
-            poFeature = OGRFeature::CreateFeature(poLayer->GetLayerDefn());
-            for (int i = 0; i < row.size(); ++i) {
-                if (i != geom_idx)
-                    funcArray[csv_column_types[i]](poFeature, csv_field_indices[i], row[i]);
-            }
-            OGRGeometry *poGeometry;
-            char* pszWKT = const_cast<char*>(row[geom_idx].c_str());
-            OGRGeometryFactory::createFromWkt(&pszWKT, NULL, &poGeometry);
-            poFeature->SetGeometryDirectly(poGeometry);
-            if ( poLayer->CreateFeature( poFeature ) != OGRERR_NONE )
-            {
-                printf( "Failed to create feature in shapefile.\n");
-                std::cout << "Program stops unexpectedly" << std::endl;
-                exit( 1 );
-            }
-            OGRFeature::DestroyFeature( poFeature );
-        };
+    bool peek(char c) {
+        skip_spaces();
+        return p < end && *p == c;
     };
-    void close() {
-        GDALClose(poDS);
+    /**
+     * Skip an optional Z, M or ZM after the geometry type
+     */
+    bool parse_dimension() {
+        skip_spaces();
+        const char *word = p;
+        while (p < end && isalpha(static_cast<unsigned char>(*p))) ++p;
+        size_t n = p - word;
+        if (n == 0 || (n == 1 && (toupper(word[0]) == 'Z' || toupper(word[0]) == 'M'))
+                || (n == 2 && strncasecmp(word, "ZM", 2) == 0)) {
+            return true;
+        }
+        // Not a dimension, it can be EMPTY
+        p = word;
+        return true;
+    };
+    bool parse_empty() {
+        skip_spaces();
+        if (end - p >= 5 && strncasecmp(p, "EMPTY", 5) == 0) {
+            p += 5;
+            return true;
+        }
+        return false;
     };
-    static void feature_set_int_field(OGRFeature *feature, int field_idx, std::string &content) {
-        int value = std::stoi(content);
-        feature->SetField(field_idx, value);
+    bool finish() {
+        skip_spaces();
+        if (p != end) return fail("unexpected text after geometry");
+        return true;
     };
-    static void feature_set_double_field(OGRFeature *feature, int field_idx, std::string &content) {
-        double value = std::stod(content);
-        feature->SetField(field_idx, value);
+    bool parse_number(double *value) {
+        skip_spaces();
+        const char *start = p;
+        while (p < end && (isdigit(static_cast<unsigned char>(*p)) || *p == '-' || *p == '+'
+                           || *p == '.' || *p == 'e' || *p == 'E')) {
+            ++p;
+        }
+        if (p == start) return fail("expected a number");
+        if (NumberParser::parse_double(start, p, value) != NUMBER_OK) {
+            p = start;
+            return fail("invalid number");
+        }
+        return true;
     };
-    static void feature_set_string_field(OGRFeature *feature, int field_idx, std::string &content) {
-        feature->SetField(field_idx, content.c_str());
+    /**
+     * Parse x y and up to two more ordinates which are ignored
+     */
+    bool parse_coordinate(FlatGeometry &geom) {
+        double x, y, ignored;
+        if (!parse_number(&x) || !parse_number(&y)) return false;
+        for (int i = 0; i < 2; ++i) {
+            skip_spaces();
+            if (p >= end || *p == ',' || *p == ')') break;
+            if (!parse_number(&ignored)) return false;
+        }
+        geom.add_point(x, y);
+        return true;
     };
-    // The size of array in class member should be explicitly specified if defined as C array.
-    // fp funcArray[3]={...};
-    typedef void (*fp)(OGRFeature *feature, int field_idx, std::string &content);
-    std::vector<fp> funcArray = {feature_set_int_field, feature_set_double_field, feature_set_string_field};
-    std::vector<OGRwkbGeometryType> ogrtypes = {wkbPoint, wkbLineString, wkbPolygon, wkbMultiPoint, wkbMultiLineString, wkbMultiPolygon};
-    GDALDataset *poDS;
-    OGRLayer *poLayer;
-    CSVConfig &conf;
-    int x_idx = -1;
-    int y_idx = -1;
-    int geom_idx = -1;
-    std::vector<int> csv_field_indices;
-    std::vector<int> csv_column_types;
-}; // SHPWriter
-
-void print_help()
-{
-    std::cout << "Usage: csv2shp -i INPUT_FILE -m XY|WKT (-x X_COLUMN_NAME, -y Y_COLUMN_NAME|-g GEOM_COLUMN) [-d ';'] -o output_file" << std::endl;
-    std::cout << "Arguments: " << std::endl;
-    std::cout << "-i (required): input file" << std::endl;
-    std::cout << "-o (required): output file" << std::endl;
-    std::cout << "-m (required): mode (xy or wkt)" << std::endl;
-    std::cout << "-g (optional): geometry column name or idx starting from 0 (Default:'geom')" << std::endl;
-    std::cout << "-x (optional): x column name or idx starting from 0 (Default:'x')" << std::endl;
-    std::cout << "-y (optional): y column name or idx starting from 0 (Default:'y')" << std::endl;
-    std::cout << "-d (optional): delimiter of CSV file (Default: ';')" << std::endl;
-    std::cout << "-H (optional): with header (t or f) (Default: 't')" << std::endl;
-    std::cout << "-h: help information" << std::endl;
-};
+    /**
+     * Parse (x y, x y, ...) as a new part
+     */
+    bool parse_points(FlatGeometry &geom, bool is_outer) {
+        if (!expect('(')) return false;
+        geom.start_part(is_outer);
+        do {
+            if (!parse_coordinate(geom)) return false;
+        } while (peek(',') && expect(','));
+        return expect(')');
+    };
+    bool parse_linestring(FlatGeometry &geom) {
+        if (parse_empty()) return true;
+        return parse_points(geom, false);
+    };
+    bool parse_polygon(FlatGeometry &geom) {
+        if (parse_empty()) return true;
+        if (!expect('(')) return false;
+        bool is_outer = true;
+        do {
+            if (!parse_points(geom, is_outer)) return false;
+            is_outer = false;
+        } while (peek(',') && expect(','));
+        return expect(')');
+    };
+    /**
+     * Points of a multipoint can be written with or without parentheses
+     */
+    bool parse_multipoint(FlatGeometry &geom) {
+        if (!expect('(')) return false;
+        do {
+            if (parse_empty()) continue;
+            if (peek('(')) {
+                if (!expect('(') || !parse_coordinate(geom) || !expect(')')) return false;
+            } else if (!parse_coordinate(geom)) {
+                return false;
+            }
+        } while (peek(',') && expect(','));
+        return expect(')');
+    };
+    bool parse_list(FlatGeometry &geom, ElementParser element) {
+        if (!expect('(')) return false;
+        do {
+            if (!(this->*element)(geom)) return false;
+        } while (peek(',') && expect(','));
+        return expect(')');
+    };
+    // Shapefile type of each type in GEOM_TYPES
+    const int shape_types[6] = {1, 3, 5, 8, 3, 5};
+    const char *begin = NULL;
+    const char *end = NULL;
+    const char *p = NULL;
+    const char *error = NULL;
+}; // WKTParser
 
 /**
- * Check if a file exists or not
- * @param  filename
- * @return
+ * Bounding box of geometries, empty until a coordinate is added
  */
-bool fileExists(std::string &filename)
-{
-    const char *filename_c_str = filename.c_str();
-    struct stat buf;
-    if (stat(filename_c_str, &buf) != -1)
-    {
-        return true;
-    }
-    return false;
-};
-
-void print_config(CSVConfig &conf){
-    std::cout << "Config information" << std::endl;
-    std::cout << "    Input file: " << conf.input_file << std::endl;
-    std::cout << "    Output file: " << conf.output_file << std::endl;
-    std::cout << "    Mode: " << (conf.mode_xy?"xy":"wkt") << std::endl;
-    if (conf.mode_xy) {
-        std::cout << "    x column or idx:" << conf.x_column << std::endl;
-        std::cout << "    y column or idx:" << conf.y_column << std::endl;
-    } else {
-        std::cout << "    wkt geom column or idx: " << conf.geom_column << std::endl;
-    }
-    std::cout << "    Delimiter: " << conf.delimiter << std::endl;
-    std::cout << "    With header: " << (conf.hasHeader?"t":"f") << std::endl;
+struct BoundingBox {
+    double minx = 0;
+    double miny = 0;
+    double maxx = 0;
+    double maxy = 0;
+    bool empty = true;
+    void extend(double x0, double y0, double x1, double y1) {
+        if (empty) {
+            minx = x0;
+            miny = y0;
+            maxx = x1;
+            maxy = y1;
+            empty = false;
+            return;
+        }
+        if (x0 < minx) minx = x0;
+        if (y0 < miny) miny = y0;
+        if (x1 > maxx) maxx = x1;
+        if (y1 > maxy) maxy = y1;
+    };
+    void extend(const BoundingBox &box) {
+        if (!box.empty) extend(box.minx, box.miny, box.maxx, box.maxy);
+    };
 };
 
-int main (int argc, char **argv)
-{
-    std::cout << "--------- csv2shp ---------" << std::endl;
-    std::cout << "---- Author: Can Yang  ----" << std::endl;
-    CSVConfig conf;
-    // std::string input_file;
+/**
+ * Output file written through a large buffer. Data already written can be
+ * patched with write_at, which is used to update headers on close.
+ */
+class OutputFile {
+public:
+    ~OutputFile() {
+        close();
+    };
+    void open(const std::string &filename) {
+        fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cerr << "--- Error, cannot create file " << filename << std::endl;
+            std::cerr << "Program stops unexpectedly" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        buffer.reserve(buffer_size);
+        written = 0;
+    };
+    void write(const char *data, size_t size) {
+        if (buffer.size() + size > buffer_size) {
+            flush();
+            if (size > buffer_size) {
+                write_fully(data, size, written);
+                written += size;
+                return;
+            }
+        }
+        buffer.insert(buffer.end(), data, data + size);
+    };
+    void write_at(size_t offset, const char *data, size_t size) {
+        flush();
+        write_fully(data, size, offset);
+    };
+    void flush() {
+        if (buffer.empty()) return;
+        write_fully(buffer.data(), buffer.size(), written);
+        written += buffer.size();
+        buffer.clear();
+    };
+    void close() {
+        if (fd < 0) return;
+        flush();
+        ::close(fd);
+        fd = -1;
+    };
+    /**
+     * Number of bytes written including the buffered ones
+     */
+    size_t size() const {
+        return written + buffer.size();
+    };
+private:
+    void write_fully(const char *data, size_t size, size_t offset) {
+        while (size > 0) {
+            ssize_t n = pwrite(fd, data, size, offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                std::cerr << "--- Error, writing output failed: " << strerror(errno) << std::endl;
+                std::cerr << "Program stops unexpectedly" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            data += n;
+            size -= n;
+            offset += n;
+        }
+    };
+    static const size_t buffer_size = 1 << 20;
+    int fd = -1;
+    size_t written = 0; // bytes already passed to the file
+    std::vector<char> buffer;
+};
+
+/**
+ * Field of a dbf file
+ */
+struct DBFField {
+    std::string name;
+    char type; // 'N' or 'C'
+    int width;
+    int decimals;
+    int offset; // offset in the record, after the deletion flag
+};
+
+/**
+ * Records serialized for the native writer. Shape records keep a
+ * placeholder for the record number, which is only known when the batch
+ * is written.
+ */
+struct NativeRecords {
+    std::vector<char> shp; // shp records including the 8 byte headers
+    std::vector<int> shp_sizes; // size of each shp record including header
+    std::vector<char> dbf; // dbf records
+    void clear() {
+        shp.clear();
+        shp_sizes.clear();
+        dbf.clear();
+    };
+};
+
+/**
+ * Writer of the .shp, .shx and .dbf files of a shapefile without going
+ * through OGRFeature. Records are serialized by the static functions, which
+ * can be called from several threads, and appended with write_records.
+ */
+class NativeShapefile {
+public:
+    static const int SHP_NULL = 0;
+    static const int SHP_POINT = 1;
+    static const int SHP_POLYLINE = 3;
+    static const int SHP_POLYGON = 5;
+    static const int SHP_MULTIPOINT = 8;
+    /**
+     * Create the files, the path is the name of the .shp file.
+     */
+    void create(const std::string &path, int _shape_type, const std::vector<DBFField> &_fields) {
+        shape_type = _shape_type;
+        fields = _fields;
+        std::string base = path.substr(0, path.size() - 4);
+        shp.open(base + ".shp");
+        shx.open(base + ".shx");
+        dbf.open(base + ".dbf");
+        record_size = 1;
+        for (size_t i = 0; i < fields.size(); ++i) record_size += fields[i].width;
+        // Headers are written again with the final values on close
+        std::vector<char> header(100, 0);
+        shp.write(header.data(), header.size());
+        shx.write(header.data(), header.size());
+        std::vector<char> dbf_header = dbf_header_bytes();
+        dbf.write(dbf_header.data(), dbf_header.size());
+    };
+    /**
+     * Append the serialized records [first, last) and patch their record
+     * numbers. shp_begin is the offset of the first one in records.shp.
+     */
+    void write_records(NativeRecords &records, size_t first, size_t last, size_t shp_begin) {
+        if (first == last) return;
+        size_t offset = shp_begin;
+        size_t file_offset = shp.size();
+        char index[8];
+        for (size_t i = first; i < last; ++i) {
+            ++num_records;
+            put_be32(&records.shp[offset], num_records);
+            put_be32(index, (file_offset + offset - shp_begin) / 2);
+            put_be32(index + 4, (records.shp_sizes[i] - 8) / 2);
+            shx.write(index, 8);
+            extend_bounds(&records.shp[offset], bounds);
+            offset += records.shp_sizes[i];
+        }
+        shp.write(&records.shp[shp_begin], offset - shp_begin);
+        dbf.write(&records.dbf[first * record_size], (last - first) * record_size);
+    };
+    /**
+     * Patch the headers with the file lengths, bounding box and number of
+     * records, then close the files.
+     */
+    void close() {
+        char eof_marker = 0x1A;
+        dbf.write(&eof_marker, 1);
+        char header[100];
+        main_header(header, shp.size());
+        shp.write_at(0, header, 100);
+        main_header(header, shx.size());
+        shx.write_at(0, header, 100);
+        std::vector<char> dbf_header = dbf_header_bytes();
+        dbf.write_at(0, dbf_header.data(), 32);
+        shp.close();
+        shx.close();
+        dbf.close();
+    };
+    /**
+     * Serialize a point record
+     */
+    static void append_point(NativeRecords &records, double x, double y) {
+        size_t offset = records.shp.size();
+        records.shp.resize(offset + 28);
+        char *p = &records.shp[offset];
+        put_be32(p + 4, 10);
+        put_le32(p + 8, SHP_POINT);
+        put_le_double(p + 12, x);
+        put_le_double(p + 20, y);
+        records.shp_sizes.push_back(28);
+    };
+    /**
+     * Size of the record of a geometry including the record header
+     */
+    static int shape_record_size(const FlatGeometry &geom) {
+        int npoints = geom.num_points();
+        if (geom.shape_type == SHP_NULL || npoints == 0) return 12;
+        if (geom.shape_type == SHP_POINT) return 28;
+        if (geom.shape_type == SHP_MULTIPOINT) return 48 + 16 * npoints;
+        return 52 + 4 * geom.parts.size() + 16 * npoints;
+    };
+    /**
+     * Serialize a record of any shape type. Polygon rings are written
+     * clockwise for exterior rings and counterclockwise for holes.
+     */
+    static void append_shape(NativeRecords &records, const FlatGeometry &geom) {
+        int npoints = geom.num_points();
+        if (geom.shape_type == SHP_NULL || npoints == 0) {
+            size_t offset = records.shp.size();
+            records.shp.resize(offset + 12);
+            put_be32(&records.shp[offset + 4], 2);
+            put_le32(&records.shp[offset + 8], SHP_NULL);
+            records.shp_sizes.push_back(12);
+            return;
+        }
+        if (geom.shape_type == SHP_POINT) {
+            append_point(records, geom.xy[0], geom.xy[1]);
+            return;
+        }
+        BoundingBox box;
+        for (int i = 0; i < npoints; ++i) {
+            box.extend(geom.xy[2 * i], geom.xy[2 * i + 1], geom.xy[2 * i], geom.xy[2 * i + 1]);
+        }
+        int nparts = geom.shape_type == SHP_MULTIPOINT ? 0 : geom.parts.size();
+        int content = shape_record_size(geom) - 8;
+        size_t offset = records.shp.size();
+        records.shp.resize(offset + 8 + content);
+        char *p = &records.shp[offset];
+        put_be32(p + 4, content / 2);
+        put_le32(p + 8, geom.shape_type);
+        put_le_double(p + 12, box.minx);
+        put_le_double(p + 20, box.miny);
+        put_le_double(p + 28, box.maxx);
+        put_le_double(p + 36, box.maxy);
+        if (geom.shape_type == SHP_MULTIPOINT) {
+            put_le32(p + 44, npoints);
+            p += 48;
+            for (int i = 0; i < 2 * npoints; ++i) put_le_double(p + 8 * i, geom.xy[i]);
+        } else {
+            put_le32(p + 44, nparts);
+            put_le32(p + 48, npoints);
+            p += 52;
+            for (int i = 0; i < nparts; ++i) put_le32(p + 4 * i, geom.parts[i]);
+            p += 4 * nparts;
+            for (int k = 0; k < nparts; ++k) {
+                int begin = geom.parts[k];
+                int end = k + 1 < nparts ? geom.parts[k + 1] : npoints;
+                bool reverse = geom.shape_type == SHP_POLYGON &&
+                               (ring_area(geom.xy.data(), begin, end) > 0) == (geom.outer[k] != 0);
+                for (int i = begin; i < end; ++i) {
+                    int j = reverse ? end - 1 - (i - begin) : i;
+                    put_le_double(p, geom.xy[2 * j]);
+                    put_le_double(p + 8, geom.xy[2 * j + 1]);
+                    p += 16;
+                }
+            }
+        }
+        records.shp_sizes.push_back(8 + content);
+    };
+    /**
+     * Write a numeric value right aligned into a dbf field.
+     */
+    static void format_int(char *dst, int width, long long value) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "%lld", value);
+        put_right_aligned(dst, width, buf, len);
+    };
+    static void format_double(char *dst, int width, int decimals, double value) {
+        char buf[64];
+        int len = snprintf(buf, sizeof(buf), "%.*f", decimals, value);
+        if (len > width) len = snprintf(buf, sizeof(buf), "%.*g", width > 7 ? width - 7 : 1, value);
+        put_right_aligned(dst, width, buf, len);
+    };
+    static void put_right_aligned(char *dst, int width, const char *src, int len) {
+        if (len > width) {
+            // Value does not fit in the field
+            memset(dst, '*', width);
+            return;
+        }
+        memset(dst, ' ', width - len);
+        memcpy(dst + width - len, src, len);
+    };
+    static void put_left_aligned(char *dst, int width, const char *src, size_t len) {
+        if (len > width) len = width;
+        memcpy(dst, src, len);
+        memset(dst + len, ' ', width - len);
+    };
+    static void put_le32(char *p, uint32_t v) {
+        p[0] = v & 0xFF;
+        p[1] = (v >> 8) & 0xFF;
+        p[2] = (v >> 16) & 0xFF;
+        p[3] = (v >> 24) & 0xFF;
+    };
+    static void put_be32(char *p, uint32_t v) {
+        p[0] = (v >> 24) & 0xFF;
+        p[1] = (v >> 16) & 0xFF;
+        p[2] = (v >> 8) & 0xFF;
+        p[3] = v & 0xFF;
+    };
+    static void put_le_double(char *p, double d) {
+        uint64_t v;
+        memcpy(&v, &d, 8);
+        put_le32(p, v & 0xFFFFFFFF);
+        put_le32(p + 4, v >> 32);
+    };
+    static uint32_t get_le32(const char *p) {
+        const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+        return u[0] | (u[1] << 8) | (u[2] << 16) | (static_cast<uint32_t>(u[3]) << 24);
+    };
+    static double get_le_double(const char *p) {
+        uint64_t v = get_le32(p) | (static_cast<uint64_t>(get_le32(p + 4)) << 32);
+        double d;
+        memcpy(&d, &v, 8);
+        return d;
+    };
+    /**
+     * Extend a box with the bounding box stored in a serialized record
+     */
+    static void extend_bounds(const char *record, BoundingBox &box) {
+        int type = get_le32(record + 8);
+        if (type == SHP_NULL) return;
+        if (type == SHP_POINT) {
+            double x = get_le_double(record + 12);
+            double y = get_le_double(record + 20);
+            box.extend(x, y, x, y);
+            return;
+        }
+        box.extend(get_le_double(record + 12), get_le_double(record + 20),
+                   get_le_double(record + 28), get_le_double(record + 36));
+    };
+    int get_record_size() const {
+        return record_size;
+    };
+    static size_t dbf_header_size(size_t num_fields) {
+        return 32 + 32 * num_fields + 1;
+    };
+    const BoundingBox &get_bounds() const {
+        return bounds;
+    };
+    /**
+     * Name of a dbf field, which is at most 10 characters and unique
+     */
+    static std::string dbf_field_name(const std::string &name, const std::vector<DBFField> &fields) {
+        std::string result = name.substr(0, 10);
+        for (int n = 1; n < 100; ++n) {
+            bool exists = false;
+            for (size_t i = 0; i < fields.size(); ++i) {
+                if (strcasecmp(fields[i].name.c_str(), result.c_str()) == 0) exists = true;
+            }
+            if (!exists) break;
+            result = name.substr(0, 8) + "_" + std::to_string(n);
+        }
+        return result;
+    };
+private:
+    /**
+     * Twice the signed area of a ring, positive if it is counterclockwise
+     */
+    static double ring_area(const double *xy, int begin, int end) {
+        double area = 0;
+        for (int i = begin; i < end; ++i) {
+            int j = i + 1 < end ? i + 1 : begin;
+            area += xy[2 * i] * xy[2 * j + 1] - xy[2 * j] * xy[2 * i + 1];
+        }
+        return area;
+    };
+    void main_header(char *header, size_t file_size) {
+        memset(header, 0, 100);
+        put_be32(header, 9994);
+        put_be32(header + 24, file_size / 2);
+        put_le32(header + 28, 1000);
+        put_le32(header + 32, shape_type);
+        put_le_double(header + 36, bounds.minx);
+        put_le_double(header + 44, bounds.miny);
+        put_le_double(header + 52, bounds.maxx);
+        put_le_double(header + 60, bounds.maxy);
+    };
+    std::vector<char> dbf_header_bytes() {
+        std::vector<char> header(dbf_header_size(fields.size()), 0);
+        time_t now = time(NULL);
+        struct tm t;
+        localtime_r(&now, &t);
+        header[0] = 0x03;
+        header[1] = t.tm_year;
+        header[2] = t.tm_mon + 1;
+        header[3] = t.tm_mday;
+        put_le32(&header[4], num_records);
+        header[8] = header.size() & 0xFF;
+        header[9] = (header.size() >> 8) & 0xFF;
+        header[10] = record_size & 0xFF;
+        header[11] = (record_size >> 8) & 0xFF;
+        header[29] = 0x57; // LDID/87, same as GDAL
+        for (size_t i = 0; i < fields.size(); ++i) {
+            char *p = &header[32 + 32 * i];
+            memcpy(p, fields[i].name.c_str(), fields[i].name.size());
+            p[11] = fields[i].type;
+            p[16] = fields[i].width;
+            p[17] = fields[i].decimals;
+        }
+        header.back() = 0x0D;
+        return header;
+    };
+    OutputFile shp;
+    OutputFile shx;
+    OutputFile dbf;
+    std::vector<DBFField> fields;
+    int shape_type = SHP_NULL;
+    int record_size = 1;
+    uint32_t num_records = 0;
+    BoundingBox bounds;
+}; // NativeShapefile
+
+/**
+ * Quadtree spatial index written as a .qix file, the format of shptree
+ * from MapServer and shapelib, which GDAL uses to filter by extent. The
+ * boxes of the shapes are collected while the shapefile is written and
+ * the tree is built when it is closed, with the same splitting rules as
+ * shapelib so that the nodes are identical.
+ */
+class SpatialIndex {
+public:
+    /**
+     * Add the box of the next shape, an empty box for a null shape
+     */
+    void add(const BoundingBox &box) {
+        if (box.empty) {
+            boxes.push_back(NAN);
+            boxes.push_back(NAN);
+            boxes.push_back(NAN);
+            boxes.push_back(NAN);
+        } else {
+            // Rounded outwards, a box is still contained in the nodes found
+            boxes.push_back(round_down(box.minx));
+            boxes.push_back(round_down(box.miny));
+            boxes.push_back(round_up(box.maxx));
+            boxes.push_back(round_up(box.maxy));
+        }
+    };
+    /**
+     * Build the tree for the extent of the shapefile and write it
+     */
+    void write(const std::string &path, const BoundingBox &extent) {
+        int num_shapes = boxes.size() / 4;
+        // Same depth as shapelib, limited to 12 levels
+        int max_depth = 0;
+        for (long long nodes = 1; nodes * 4 < num_shapes; nodes *= 2) ++max_depth;
+        max_depth = std::min(max_depth, 12);
+        nodes.clear();
+        Node root;
+        root.bounds[0] = extent.minx;
+        root.bounds[1] = extent.miny;
+        root.bounds[2] = extent.maxx;
+        root.bounds[3] = extent.maxy;
+        nodes.push_back(root);
+        for (int id = 0; id < num_shapes; ++id) {
+            if (boxes[4 * id] != boxes[4 * id]) continue; // null shape
+            insert(id, &boxes[4 * id], max_depth);
+        }
+        trim(0);
+        std::vector<uint32_t> sizes(nodes.size());
+        subtree_size(0, sizes);
+        OutputFile out;
+        out.open(path);
+        char header[16] = {'S', 'Q', 'T', 1, 1, 0, 0, 0}; // LSB order, version 1
+        NativeShapefile::put_le32(header + 8, num_shapes);
+        NativeShapefile::put_le32(header + 12, max_depth);
+        out.write(header, 16);
+        write_node(out, 0, sizes);
+        out.close();
+    };
+private:
+    struct Node {
+        double bounds[4]; // minx, miny, maxx, maxy
+        std::vector<int> ids;
+        int subnodes[4] = {0, 0, 0, 0};
+        int num_subnodes = 0;
+    };
+    static float round_down(double v) {
+        float f = static_cast<float>(v);
+        return f > v ? nextafterf(f, -INFINITY) : f;
+    };
+    static float round_up(double v) {
+        float f = static_cast<float>(v);
+        return f < v ? nextafterf(f, INFINITY) : f;
+    };
+    static bool contains(const double *bounds, const float *box) {
+        return box[0] >= bounds[0] && box[1] >= bounds[1] && box[2] <= bounds[2] && box[3] <= bounds[3];
+    };
+    /**
+     * Split bounds in two along the longer axis, each part covering 55%
+     */
+    static void split_bounds(const double *in, double *out1, double *out2) {
+        memcpy(out1, in, 4 * sizeof(double));
+        memcpy(out2, in, 4 * sizeof(double));
+        int axis = in[2] - in[0] > in[3] - in[1] ? 0 : 1;
+        double range = in[axis + 2] - in[axis];
+        out1[axis + 2] = in[axis] + range * 0.55;
+        out2[axis] = in[axis + 2] - range * 0.55;
+    };
+    void insert(int id, const float *box, int depth) {
+        int node = 0;
+        while (depth > 1) {
+            if (nodes[node].num_subnodes == 0) {
+                double half1[4], half2[4], quads[4][4];
+                split_bounds(nodes[node].bounds, half1, half2);
+                split_bounds(half1, quads[0], quads[1]);
+                split_bounds(half2, quads[2], quads[3]);
+                bool fits = false;
+                for (int q = 0; q < 4; ++q) fits = fits || contains(quads[q], box);
+                if (!fits) break;
+                for (int q = 0; q < 4; ++q) {
+                    Node sub;
+                    memcpy(sub.bounds, quads[q], sizeof(sub.bounds));
+                    nodes[node].subnodes[q] = nodes.size();
+                    nodes.push_back(sub);
+                }
+                nodes[node].num_subnodes = 4;
+            }
+            int next = -1;
+            for (int q = 0; q < nodes[node].num_subnodes && next < 0; ++q) {
+                if (contains(nodes[nodes[node].subnodes[q]].bounds, box)) next = nodes[node].subnodes[q];
+            }
+            if (next < 0) break;
+            node = next;
+            --depth;
+        }
+        nodes[node].ids.push_back(id);
+    };
+    /**
+     * Remove the subnodes without any shape
+     * @return true if the node is empty
+     */
+    bool trim(int node) {
+        Node &n = nodes[node];
+        for (int q = 0; q < n.num_subnodes; ++q) {
+            if (trim(n.subnodes[q])) {
+                n.subnodes[q] = n.subnodes[n.num_subnodes - 1];
+                --n.num_subnodes;
+                --q;
+            }
+        }
+        return n.num_subnodes == 0 && n.ids.empty();
+    };
+    /**
+     * Bytes of the subnodes of a node, which is the offset written before
+     * its bounds to skip them.
+     */
+    uint32_t subtree_size(int node, std::vector<uint32_t> &sizes) {
+        uint32_t size = 0;
+        for (int q = 0; q < nodes[node].num_subnodes; ++q) {
+            int sub = nodes[node].subnodes[q];
+            size += 44 + 4 * nodes[sub].ids.size() + subtree_size(sub, sizes);
+        }
+        sizes[node] = size;
+        return size;
+    };
+    void write_node(OutputFile &out, int node, const std::vector<uint32_t> &sizes) {
+        const Node &n = nodes[node];
+        std::vector<char> buf(44 + 4 * n.ids.size());
+        NativeShapefile::put_le32(&buf[0], sizes[node]);
+        for (int i = 0; i < 4; ++i) NativeShapefile::put_le_double(&buf[4 + 8 * i], n.bounds[i]);
+        NativeShapefile::put_le32(&buf[36], n.ids.size());
+        for (size_t i = 0; i < n.ids.size(); ++i) NativeShapefile::put_le32(&buf[40 + 4 * i], n.ids[i]);
+        NativeShapefile::put_le32(&buf[40 + 4 * n.ids.size()], n.num_subnodes);
+        out.write(buf.data(), buf.size());
+        for (int q = 0; q < n.num_subnodes; ++q) write_node(out, n.subnodes[q], sizes);
+    };
+    std::vector<float> boxes; // minx, miny, maxx, maxy of each shape
+    std::vector<Node> nodes;
+}; // SpatialIndex
+
+/**
+ * Features created from rows but not written yet, either as OGRFeatures or
+ * as records serialized for the native writer.
+ */
+struct FeatureBatch {
+    std::vector<OGRFeature *> features;
+    std::vector<int> shp_sizes; // size of the shp record of each feature
+    std::vector<BoundingBox> bounds; // bounding box of each feature
+    NativeRecords records;
+    size_t size = 0;
+    void clear() {
+        features.clear();
+        shp_sizes.clear();
+        bounds.clear();
+        records.clear();
+        size = 0;
+    };
+    /**
+     * Size of the shp record of feature i, with either writer
+     */
+    int shp_size(size_t i) const {
+        return features.empty() ? records.shp_sizes[i] : shp_sizes[i];
+    };
+};
+
+/**
+ * Largest .shp or .dbf file written, files beyond 2GB are not supported by
+ * most readers of the format.
+ */
+const long long SHAPEFILE_MAX_BYTES = 2147483647LL;
+
+/**
+ * Layout shared by all the shards of an output
+ */
+struct OutputSchema {
+    bool native = false;
+    int shape_type = NativeShapefile::SHP_NULL; // native writer
+    std::vector<DBFField> fields; // native writer
+    GDALDriver *driver = NULL; // GDAL
+    OGRFeatureDefn *feature_defn = NULL; // GDAL, fields of the features
+    OGRwkbGeometryType geometry_type = wkbUnknown; // GDAL
+    long long max_rows = 0; // rows of a shard, 0 for no limit
+    long long max_bytes = SHAPEFILE_MAX_BYTES; // size of the .shp and .dbf files of a shard
+    bool spatial_index = false; // write a .qix file with each shard
+};
+
+/**
+ * File, range of rows and extent of a shard, listed in the manifest
+ */
+struct ShardInfo {
+    std::string path;
+    long long first_row = 0; // number of the first feature, starting from 1
+    long long rows = 0;
+    BoundingBox bounds;
+};
+
+/**
+ * One shapefile of the output, written with the native writer or GDAL.
+ * The sizes of the .shp and .dbf files are tracked from the record sizes,
+ * so that no record is added once the shard would grow past its limits.
+ */
+class ShardWriter {
+public:
+    ShardWriter(const OutputSchema &_schema, const std::string &path, long long first_row): schema(_schema) {
+        info.path = path;
+        info.first_row = first_row;
+        if (schema.native) {
+            native.create(path, schema.shape_type, schema.fields);
+            record_size = native.get_record_size();
+            dbf_size = NativeShapefile::dbf_header_size(schema.fields.size());
+            return;
+        }
+        poDS = schema.driver->Create(path.c_str(), 0, 0, 0, GDT_Unknown, NULL );
+        if ( poDS == NULL )
+        {
+            fprintf(stderr, "Creation of output file failed.\n" );
+            std::cerr << "Program stops unexpectedly" << std::endl;
+            exit( 1 );
+        }
+        poLayer = poDS->CreateLayer("layer", NULL, schema.geometry_type, NULL );
+        if ( poLayer == NULL )
+        {
+            fprintf(stderr, "Layer creation failed.\n" );
+            std::cerr << "Program stops unexpectedly" << std::endl;
+            exit( 1 );
+        }
+        for (int i = 0; i < schema.feature_defn->GetFieldCount(); ++i) {
+            OGRFieldDefn *field = schema.feature_defn->GetFieldDefn(i);
+            if ( poLayer->CreateField( field ) != OGRERR_NONE )
+            {
+                fprintf(stderr, "Creating field %s failed.\n", field->GetNameRef());
+                std::cerr << "Program stops unexpectedly" << std::endl;
+                exit( 1 );
+            }
+        }
+        record_size = dbf_record_size(poLayer->GetLayerDefn());
+        dbf_size = NativeShapefile::dbf_header_size(poLayer->GetLayerDefn()->GetFieldCount());
+    };
+    ~ShardWriter() {
+        close();
+    };
+    /**
+     * Account for one more record with a shp record of shp_record_size
+     * bytes. An empty shard accepts any record.
+     * @return false if the shard is full
+     */
+    bool add_record(int shp_record_size) {
+        if (info.rows > 0) {
+            if (schema.max_rows > 0 && info.rows >= schema.max_rows) return false;
+            // The dbf file ends with a one byte marker
+            if (shp_size + shp_record_size > schema.max_bytes || dbf_size + record_size + 1 > schema.max_bytes) return false;
+        }
+        ++info.rows;
+        shp_size += shp_record_size;
+        dbf_size += record_size;
+        return true;
+    };
+    /**
+     * Write the features [first, last) of a batch, which have been counted
+     * with add_record. shp_begin is the offset of the first native record.
+     */
+    void write(FeatureBatch &batch, size_t first, size_t last, size_t shp_begin) {
+        if (schema.native) {
+            if (schema.spatial_index) {
+                size_t offset = shp_begin;
+                for (size_t i = first; i < last; ++i) {
+                    BoundingBox box;
+                    NativeShapefile::extend_bounds(&batch.records.shp[offset], box);
+                    index.add(box);
+                    offset += batch.records.shp_sizes[i];
+                }
+            }
+            native.write_records(batch.records, first, last, shp_begin);
+            return;
+        }
+        for (size_t i = first; i < last; ++i) {
+            if ( poLayer->CreateFeature( batch.features[i] ) != OGRERR_NONE )
+            {
+                fprintf(stderr, "Failed to create feature in shapefile.\n");
+                std::cerr << "Program stops unexpectedly" << std::endl;
+                exit( 1 );
+            }
+            OGRFeature::DestroyFeature( batch.features[i] );
+            info.bounds.extend(batch.bounds[i]);
+            if (schema.spatial_index) index.add(batch.bounds[i]);
+        }
+    };
+    void close() {
+        if (closed) return;
+        closed = true;
+        if (schema.native) {
+            native.close();
+            info.bounds = native.get_bounds();
+        } else {
+            GDALClose(poDS);
+        }
+        if (schema.spatial_index) index.write(index_path(info.path), info.bounds);
+    };
+    /**
+     * Path of the .qix file of a shard. Without the .shp extension GDAL
+     * creates a directory with the shapefile of the layer inside.
+     */
+    static std::string index_path(const std::string &path) {
+        if (path.size() > 4 && strcasecmp(path.c_str() + path.size() - 4, ".shp") == 0) {
+            return path.substr(0, path.size() - 4) + ".qix";
+        }
+        return path + "/layer.qix";
+    };
+    const ShardInfo &get_info() const {
+        return info;
+    };
+    /**
+     * Size of a dbf record for the fields of a layer. A width of 0 is the
+     * default width used by the shapefile driver of GDAL.
+     */
+    static int dbf_record_size(OGRFeatureDefn *defn) {
+        int size = 1;
+        for (int i = 0; i < defn->GetFieldCount(); ++i) {
+            OGRFieldDefn *field = defn->GetFieldDefn(i);
+            int width = field->GetWidth();
+            if (width <= 0) {
+                switch (field->GetType()) {
+                case OFTInteger:
+                    width = 9;
+                    break;
+                case OFTInteger64:
+                    width = 18;
+                    break;
+                case OFTReal:
+                    width = 24;
+                    break;
+                default:
+                    width = 80;
+                    break;
+                }
+            }
+            size += std::min(width, 255);
+        }
+        return size;
+    };
+private:
+    const OutputSchema &schema;
+    ShardInfo info;
+    NativeShapefile native;
+    GDALDataset *poDS = NULL;
+    OGRLayer *poLayer = NULL;
+    SpatialIndex index;
+    long long shp_size = 100; // bytes of the .shp file including its header
+    long long dbf_size = 0; // bytes of the .dbf file without the end marker
+    int record_size = 1;
+    bool closed = false;
+};
+
+/**
+ * Conversion of the attribute cells of a row, resolved once from the column
+ * types: one step per written column, with the geometry columns left out.
+ */
+struct ConversionPlan {
+    struct Step {
+        int column; // index of the cell in the row
+        int field; // index of the field in the output
+        int type; // column type, 0 int, 1 double, 2 string, 3 int64
+        int offset; // native writer: offset of the field in the dbf record
+        int width; // native writer: width of the field
+        int decimals; // native writer: decimals of the field
+    };
+    std::vector<Step> steps;
+    int uniform_type = -1; // type of all the steps, -1 if they differ
+    size_t min_row_size = 0; // rows with fewer cells are converted with bounds checks
+};
+
+class SHPWriter {
+public:
+    SHPWriter(CSVConfig &_conf, CSVReader &_reader): conf(_conf), reader(_reader) {
+        std::string output_file = conf.output_file;
+        std::vector<std::string> headers = reader.get_headers();
+        x_idx = reader.get_x_idx();
+        y_idx = reader.get_y_idx();
+        geom_idx = reader.get_geom_idx();
+        csv_column_types = reader.get_column_types();
+        column_stats = reader.get_column_stats();
+        int geom_type_idx = reader.get_geom_type_idx();
+        use_native = conf.native_writer && has_shp_extension(output_file);
+        if (conf.native_writer && !use_native) {
+            std::cerr << "Native writer needs a .shp output file, GDAL is used instead" << std::endl;
+        }
+        schema.max_rows = conf.max_rows;
+        schema.spatial_index = conf.spatial_index;
+        if (conf.max_bytes > 0) schema.max_bytes = conf.max_bytes;
+        if (use_native) {
+            create_native(headers, geom_type_idx);
+            return;
+        }
+        const char *pszDriverName = "ESRI Shapefile";
+        GDALDriver *poDriver;
+        GDALAllRegister();
+        poDriver = GetGDALDriverManager()->GetDriverByName(pszDriverName );
+        if ( poDriver == NULL )
+        {
+            fprintf(stderr, "%s driver not available.\n", pszDriverName );
+            std::cerr << "Program stops unexpectedly" << std::endl;
+            exit( 1 );
+        }
+        schema.driver = poDriver;
+        schema.geometry_type = ogrtypes[geom_type_idx];
+        // The fields are defined once and created in the layer of each shard
+        schema.feature_defn = new OGRFeatureDefn("layer");
+        schema.feature_defn->Reference();
+        schema.feature_defn->SetGeomType(schema.geometry_type);
+        csv_field_indices = std::vector<int>(headers.size());
+        int temp = 0;
+        for (int i = 0; i < headers.size(); ++i) {
+            // Define fields
+            if ((!conf.mode_xy && i == geom_idx) || (conf.mode_xy && i == x_idx)
+                    || (conf.mode_xy && i == y_idx)) {
+                csv_field_indices[i] = -1;
+                continue;
+            }
+            int width, precision;
+            get_field_size(i, &width, &precision);
+            if (csv_column_types[i] == 0 || csv_column_types[i] == 3) {
+                // int or int64
+                OGRFieldDefn oField(headers[i].c_str(), csv_column_types[i] == 0 ? OFTInteger : OFTInteger64);
+                if (width > 0) oField.SetWidth(width);
+                schema.feature_defn->AddFieldDefn(&oField);
+            } else if (csv_column_types[i] == 1) {
+                // Double
+                OGRFieldDefn oField(headers[i].c_str(), OFTReal);
+                if (width > 0) {
+                    oField.SetWidth(width);
+                    oField.SetPrecision(precision);
+                }
+                schema.feature_defn->AddFieldDefn(&oField);
+            } else { // string
+                OGRFieldDefn oField(headers[i].c_str(), OFTString);
+                oField.SetWidth(width);
+                schema.feature_defn->AddFieldDefn(&oField);
+            }
+            csv_field_indices[i] = temp;
+            temp++;
+        }
+        fprintf(stderr, "Fields count excluding geometry %d.\n", temp);
+        build_plan();
+    };
+    /**
+     * Write a row, features are buffered and written in batches.
+     * @return false if the row is empty and skipped
+     */
+    template <class Timer>
+    bool write_data(const CSVRow &row, Timer &timer) {
+        if (!add_to_batch(row, pending, timer)) return false;
+        if (pending.size >= batch_size) write_batch(pending, timer);
+        return true;
+    };
+    /**
+     * Create the feature of a row and add it to a batch. It can be called
+     * from several threads with different batches and timers.
+     * @return false if the row is empty and skipped
+     */
+    template <class Timer>
+    bool add_to_batch(const CSVRow &row, FeatureBatch &batch, Timer &timer) {
+        if (row.empty()) return false;
+        if (use_native) {
+            serialize_row(row, batch.records, timer);
+        } else {
+            int shp_size;
+            BoundingBox bounds;
+            batch.features.push_back(create_feature(row, &shp_size, &bounds, timer));
+            batch.shp_sizes.push_back(shp_size);
+            batch.bounds.push_back(bounds);
+        }
+        ++batch.size;
+        return true;
+    };
+    /**
+     * Write the features of a batch and clear it. The output rolls over to
+     * a new shard when a feature does not fit in the current one.
+     */
+    template <class Timer>
+    void write_batch(FeatureBatch &batch, Timer &timer) {
+        if (shard == NULL) open_shard();
+        size_t first = 0;
+        size_t shp_begin = 0;
+        size_t shp_offset = 0;
+        for (size_t i = 0; i < batch.size; ++i) {
+            int shp_size = batch.shp_size(i);
+            if (!shard->add_record(shp_size)) {
+                shard->write(batch, first, i, shp_begin);
+                timer.lap(STAGE_CREATE_FEATURE, i - first);
+                open_shard();
+                timer.lap(STAGE_FLUSH);
+                shard->add_record(shp_size);
+                first = i;
+                shp_begin = shp_offset;
+            }
+            shp_offset += shp_size;
+        }
+        shard->write(batch, first, batch.size, shp_begin);
+        timer.lap(STAGE_CREATE_FEATURE, batch.size - first);
+        batch.clear();
+    };
+    /**
+     * Write a whole batch to a shard created by the caller, used when the
+     * shards are written concurrently. Their rows are known in advance,
+     * so a shard that would need to roll over is an error.
+     */
+    template <class Timer>
+    void write_to_shard(ShardWriter &target, FeatureBatch &batch, Timer &timer) {
+        for (size_t i = 0; i < batch.size; ++i) {
+            if (!target.add_record(batch.shp_size(i))) {
+                std::cerr << "--- Error, shard " << target.get_info().path
+                          << " exceeds the size limit, use a smaller --max-rows" << std::endl;
+                std::cerr << "Program stops unexpectedly" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        target.write(batch, 0, batch.size, 0);
+        timer.lap(STAGE_CREATE_FEATURE, batch.size);
+        batch.clear();
+    };
+    /**
+     * Number of rows of each shard when it is known before converting the
+     * rows: the --max-rows limit, or the size limit for point layers whose
+     * records all have the same size.
+     * @return number of rows, 0 if it is unknown
+     */
+    long long get_shard_rows() {
+        long long rows = schema.max_rows;
+        if (reader.get_geom_type_idx() == 0) {
+            int record_size = use_native ? native_record_size : ShardWriter::dbf_record_size(schema.feature_defn);
+            size_t num_fields = use_native ? schema.fields.size() : schema.feature_defn->GetFieldCount();
+            long long by_shp = (schema.max_bytes - 100) / 28;
+            long long by_dbf = (schema.max_bytes - (long long) NativeShapefile::dbf_header_size(num_fields) - 1) / record_size;
+            long long by_bytes = std::max(1LL, std::min(by_shp, by_dbf));
+            rows = rows > 0 ? std::min(rows, by_bytes) : by_bytes;
+        }
+        return rows;
+    };
+    const OutputSchema &get_schema() const {
+        return schema;
+    };
+    /**
+     * Path of shard number n, starting from 1: the name of the output
+     * followed by _0001, _0002...
+     */
+    std::string shard_path(int n) const {
+        std::string stem = conf.output_file;
+        std::string ext;
+        if (has_shp_extension(stem)) {
+            ext = stem.substr(stem.size() - 4);
+            stem = stem.substr(0, stem.size() - 4);
+        }
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), "_%04d", n);
+        return stem + suffix + ext;
+    };
+    /**
+     * Add the shards written concurrently, in the order of the input
+     */
+    void add_shards(const std::vector<ShardInfo> &infos) {
+        shards.insert(shards.end(), infos.begin(), infos.end());
+    };
+    /**
+     * Close the current shard and open the next one. The first shard has
+     * the name of the output and is renamed with number 1 when a second
+     * one is needed.
+     */
+    void open_shard() {
+        close_shard();
+        if (shards.empty()) {
+            shard = new ShardWriter(schema, conf.output_file, 1);
+            return;
+        }
+        if (shards.size() == 1) {
+            rename_output(shards[0].path, shard_path(1));
+            shards[0].path = shard_path(1);
+        }
+        const ShardInfo &last = shards.back();
+        std::string path = shard_path(shards.size() + 1);
+        std::cerr << "Output rolls over to " << path << std::endl;
+        shard = new ShardWriter(schema, path, last.first_row + last.rows);
+    };
+    void close_shard() {
+        if (shard == NULL) return;
+        shard->close();
+        shards.push_back(shard->get_info());
+        delete shard;
+        shard = NULL;
+    };
+    /**
+     * Rename a closed shapefile with its side files, or the directory
+     * created by GDAL for an output without the .shp extension.
+     */
+    static void rename_output(const std::string &from, const std::string &to) {
+        std::vector<std::string> extensions(1, "");
+        if (has_shp_extension(from)) {
+            extensions.push_back(".shx");
+            extensions.push_back(".dbf");
+            extensions.push_back(".prj");
+            extensions.push_back(".cpg");
+            extensions.push_back(".qix");
+        }
+        for (size_t i = 0; i < extensions.size(); ++i) {
+            std::string source = i == 0 ? from : from.substr(0, from.size() - 4) + extensions[i];
+            std::string target = i == 0 ? to : to.substr(0, to.size() - 4) + extensions[i];
+            if (::rename(source.c_str(), target.c_str()) != 0 && errno != ENOENT) {
+                std::cerr << "--- Error, cannot rename " << source << " to " << target << ": " << strerror(errno) << std::endl;
+                std::cerr << "Program stops unexpectedly" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+    };
+    /**
+     * Write the list of shards with their range of rows and extent to
+     * NAME_manifest.json next to the output.
+     */
+    void write_manifest() {
+        std::string stem = conf.output_file;
+        if (has_shp_extension(stem)) stem = stem.substr(0, stem.size() - 4);
+        std::string path = stem + "_manifest.json";
+        std::ofstream out(path.c_str());
+        out.precision(15);
+        out << "{\n  \"shards\": [\n";
+        for (size_t i = 0; i < shards.size(); ++i) {
+            const ShardInfo &info = shards[i];
+            std::string file = info.path.substr(info.path.find_last_of('/') + 1);
+            out << "    {\"file\": \"" << json_escape(file) << "\", \"first_row\": " << info.first_row
+                << ", \"last_row\": " << info.first_row + info.rows - 1 << ", \"rows\": " << info.rows << ", \"extent\": ";
+            if (info.bounds.empty) {
+                out << "null";
+            } else {
+                out << "[" << info.bounds.minx << ", " << info.bounds.miny << ", "
+                    << info.bounds.maxx << ", " << info.bounds.maxy << "]";
+            }
+            out << "}" << (i + 1 < shards.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+        if (!out) {
+            std::cerr << "--- Error, cannot write manifest " << path << std::endl;
+            std::cerr << "Program stops unexpectedly" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::cerr << "Manifest of " << shards.size() << " shard(s) written to " << path << std::endl;
+    };
+    static std::string json_escape(const std::string &s) {
+        std::string result;
+        for (size_t i = 0; i < s.size(); ++i) {
+            if (s[i] == '"' || s[i] == '\\') result += '\\';
+            result += s[i];
+        }
+        return result;
+    };
+    /**
+     * Create a feature from a row without writing it. It only reads the
+     * layer definition so it can be called from several threads.
+     */
+    template <class Timer>
+    OGRFeature *create_feature(const CSVRow &row, int *shp_size, BoundingBox *bounds, Timer &timer) {
+        OGRFeature *poFeature;
+        poFeature = OGRFeature::CreateFeature(schema.feature_defn);
+        timer.lap(STAGE_BUILD_FEATURE, 0);
+        FeatureTarget target = {poFeature};
+        apply_plan(row, target);
+        timer.lap(STAGE_NUMERIC_PARSE);
+        if (conf.mode_xy) {
+            // XY format
+            OGRPoint pt;
+            pt.setX( parse_coordinate(row, x_idx) );
+            pt.setY( parse_coordinate(row, y_idx) );
+            timer.lap(STAGE_NUMERIC_PARSE, 0);
+            // When the geometry is created from OGRGeometryFactory, the SetGeometryDirectly should be used.
+            poFeature->SetGeometry(&pt);
+            *shp_size = 28;
+            bounds->extend(pt.getX(), pt.getY(), pt.getX(), pt.getY());
+        } else {
+            // WKT format
+            static thread_local FlatGeometry geom;
+            parse_geometry(row, geom);
+            timer.lap(STAGE_WKT_PARSE);
+            poFeature->SetGeometryDirectly(to_ogr_geometry(geom));
+            *shp_size = NativeShapefile::shape_record_size(geom);
+            for (int i = 0; i < geom.num_points(); ++i) {
+                bounds->extend(geom.xy[2 * i], geom.xy[2 * i + 1], geom.xy[2 * i], geom.xy[2 * i + 1]);
+            }
+        }
+        timer.lap(STAGE_BUILD_FEATURE);
+        return poFeature;
+    };
+    /**
+     * Write the pending features and close the output. A manifest is
+     * written when the output has several shards or a limit is given.
+     */
+    template <class Timer>
+    void close(Timer &timer) {
+        if (pending.size > 0 || shards.empty()) write_batch(pending, timer);
+        close_shard();
+        if (shards.size() > 1 || conf.max_rows > 0 || conf.max_bytes > 0) write_manifest();
+        timer.lap(STAGE_FLUSH);
+        if (schema.feature_defn != NULL) schema.feature_defn->Release();
+        schema.feature_defn = NULL;
+    };
+    /**
+     * Width and precision of the field of column i, computed from the column
+     * statistics. Without statistics the width is 0, which means the default
+     * of the writer, except for strings which are 100 characters.
+     */
+    void get_field_size(int i, int *width, int *precision) {
+        *width = 0;
+        *precision = 0;
+        if (column_stats.empty()) {
+            if (csv_column_types[i] == 2) *width = 100;
+            return;
+        }
+        const ColumnStats &stats = column_stats[i];
+        switch (csv_column_types[i]) {
+        case 0:
+        case 3:
+            *width = std::max(1, std::min(stats.width, 20));
+            break;
+        case 1:
+            if (stats.exponent) {
+                *width = 24;
+                *precision = 15;
+            } else {
+                int int_digits = std::max(1, std::min(stats.int_digits, 22));
+                *precision = std::min(stats.decimals, 24 - int_digits - 1);
+                *width = int_digits + (*precision > 0 ? *precision + 1 : 0);
+            }
+            break;
+        default:
+            *width = std::max(1, std::min(stats.width, 254));
+            break;
+        }
+    };
+    static bool has_shp_extension(const std::string &filename) {
+        return filename.size() > 4 && strcasecmp(filename.c_str() + filename.size() - 4, ".shp") == 0;
+    };
+    /**
+     * Set up the fields of the native writer
+     */
+    void create_native(const std::vector<std::string> &headers, int geom_type_idx) {
+        std::vector<DBFField> fields;
+        csv_field_indices = std::vector<int>(headers.size());
+        int offset = 1;
+        for (int i = 0; i < headers.size(); ++i) {
+            if ((!conf.mode_xy && i == geom_idx) || (conf.mode_xy && i == x_idx)
+                    || (conf.mode_xy && i == y_idx)) {
+                csv_field_indices[i] = -1;
+                continue;
+            }
+            DBFField field;
+            field.name = NativeShapefile::dbf_field_name(headers[i], fields);
+            int width, precision;
+            get_field_size(i, &width, &precision);
+            if (csv_column_types[i] == 0 || csv_column_types[i] == 3) {
+                field.type = 'N';
+                field.width = width > 0 ? width : (csv_column_types[i] == 0 ? 11 : 20);
+                field.decimals = 0;
+            } else if (csv_column_types[i] == 1) {
+                // Same as the default of GDAL for OFTReal
+                field.type = 'N';
+                field.width = width > 0 ? width : 24;
+                field.decimals = width > 0 ? precision : 15;
+            } else {
+                field.type = 'C';
+                field.width = width;
+                field.decimals = 0;
+            }
+            field.offset = offset;
+            offset += field.width;
+            csv_field_indices[i] = fields.size();
+            fields.push_back(field);
+        }
+        schema.native = true;
+        schema.fields = fields;
+        schema.shape_type = native_shape_types[geom_type_idx];
+        native_record_size = offset;
+        fprintf(stderr, "Fields count excluding geometry %d.\n", (int) fields.size());
+        build_plan();
+    };
+    /**
+     * Resolve the conversion steps of the attribute columns
+     */
+    void build_plan() {
+        plan = ConversionPlan();
+        for (int i = 0; i < csv_field_indices.size(); ++i) {
+            if (csv_field_indices[i] < 0) continue;
+            ConversionPlan::Step step;
+            step.column = i;
+            step.field = csv_field_indices[i];
+            step.type = csv_column_types[i];
+            step.offset = step.width = step.decimals = 0;
+            if (use_native) {
+                step.offset = schema.fields[step.field].offset;
+                step.width = schema.fields[step.field].width;
+                step.decimals = schema.fields[step.field].decimals;
+            }
+            plan.uniform_type = plan.steps.empty() || plan.uniform_type == step.type ? step.type : -1;
+            plan.min_row_size = i + 1;
+            plan.steps.push_back(step);
+        }
+    };
+    /**
+     * Convert the attribute cells of a row with the plan. Target is
+     * FeatureTarget or RecordTarget and is resolved at compile time, and
+     * rows whose columns all have the same type take a loop without any
+     * dispatch.
+     */
+    template <class Target>
+    void apply_plan(const CSVRow &row, Target &target) {
+        const ConversionPlan::Step *step = plan.steps.data();
+        const ConversionPlan::Step *end = step + plan.steps.size();
+        if (row.size() < plan.min_row_size) {
+            // Missing cells are left null
+            for (; step != end; ++step) {
+                if (step->column < row.size()) convert_cell(*step, row[step->column], target);
+            }
+            return;
+        }
+        switch (plan.uniform_type) {
+        case 0:
+            for (; step != end; ++step) target.set_int(*step, row[step->column]);
+            break;
+        case 1:
+            for (; step != end; ++step) target.set_double(*step, row[step->column]);
+            break;
+        case 2:
+            for (; step != end; ++step) target.set_string(*step, row[step->column]);
+            break;
+        case 3:
+            for (; step != end; ++step) target.set_int64(*step, row[step->column]);
+            break;
+        default:
+            for (; step != end; ++step) convert_cell(*step, row[step->column], target);
+            break;
+        }
+    };
+    template <class Target>
+    static void convert_cell(const ConversionPlan::Step &step, const CSVCell &cell, Target &target) {
+        switch (step.type) {
+        case 0:
+            target.set_int(step, cell);
+            break;
+        case 1:
+            target.set_double(step, cell);
+            break;
+        case 2:
+            target.set_string(step, cell);
+            break;
+        default:
+            target.set_int64(step, cell);
+            break;
+        }
+    };
+    /**
+     * Sets the fields of an OGRFeature. Empty or invalid numbers are left
+     * unset, which makes them null.
+     */
+    struct FeatureTarget {
+        OGRFeature *feature;
+        void set_int(const ConversionPlan::Step &step, const CSVCell &cell) {
+            long long value;
+            if (cell_to_long(cell, &value)) feature->SetField(step.field, static_cast<int>(value));
+        };
+        void set_int64(const ConversionPlan::Step &step, const CSVCell &cell) {
+            long long value;
+            if (cell_to_long(cell, &value)) feature->SetField(step.field, static_cast<GIntBig>(value));
+        };
+        void set_double(const ConversionPlan::Step &step, const CSVCell &cell) {
+            double value;
+            if (cell_to_double(cell, &value)) feature->SetField(step.field, value);
+        };
+        void set_string(const ConversionPlan::Step &step, const CSVCell &cell) {
+            cell.copy_to(cell_buffer());
+            feature->SetField(step.field, cell_buffer().c_str());
+        };
+    };
+    /**
+     * Writes the fields of a dbf record filled with spaces. Empty or invalid
+     * numbers are left blank, which makes them null.
+     */
+    struct RecordTarget {
+        char *record;
+        void set_int(const ConversionPlan::Step &step, const CSVCell &cell) {
+            char *dst = record + step.offset;
+            if (is_plain_number(cell, false)) {
+                // The text is already a valid dbf number
+                NativeShapefile::put_right_aligned(dst, step.width, cell.data, cell.size);
+                return;
+            }
+            long long value;
+            if (!cell.empty() && cell_to_long(cell, &value)) NativeShapefile::format_int(dst, step.width, value);
+        };
+        void set_int64(const ConversionPlan::Step &step, const CSVCell &cell) {
+            set_int(step, cell);
+        };
+        void set_double(const ConversionPlan::Step &step, const CSVCell &cell) {
+            if (step.decimals == 0) {
+                // Real field without decimals, written like an integer
+                set_int(step, cell);
+                return;
+            }
+            char *dst = record + step.offset;
+            if (is_plain_number(cell, true)) {
+                NativeShapefile::put_right_aligned(dst, step.width, cell.data, cell.size);
+                return;
+            }
+            double value;
+            if (!cell.empty() && cell_to_double(cell, &value)) {
+                NativeShapefile::format_double(dst, step.width, step.decimals, value);
+            }
+        };
+        void set_string(const ConversionPlan::Step &step, const CSVCell &cell) {
+            NativeShapefile::put_left_aligned(record + step.offset, step.width, cell.data, cell.size);
+        };
+    };
+    /**
+     * Serialize the dbf and shp records of a row for the native writer
+     */
+    template <class Timer>
+    void serialize_row(const CSVRow &row, NativeRecords &records, Timer &timer) {
+        size_t offset = records.dbf.size();
+        records.dbf.resize(offset + native_record_size, ' ');
+        RecordTarget target = {&records.dbf[offset]};
+        apply_plan(row, target);
+        if (conf.mode_xy) {
+            double x = parse_coordinate(row, x_idx);
+            double y = parse_coordinate(row, y_idx);
+            timer.lap(STAGE_NUMERIC_PARSE);
+            NativeShapefile::append_point(records, x, y);
+            timer.lap(STAGE_BUILD_FEATURE);
+            return;
+        }
+        timer.lap(STAGE_NUMERIC_PARSE);
+        static thread_local FlatGeometry geom;
+        parse_geometry(row, geom);
+        timer.lap(STAGE_WKT_PARSE);
+        if (geom.shape_type != NativeShapefile::SHP_NULL && geom.shape_type != schema.shape_type) {
+            std::cerr << "--- Error, geometry type does not match the layer: " << row[geom_idx].str() << std::endl;
+            std::cerr << "Program stops unexpectedly" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        NativeShapefile::append_shape(records, geom);
+        timer.lap(STAGE_BUILD_FEATURE);
+    };
+    /**
+     * Check if a cell only contains an optional sign, digits and, if
+     * decimals are allowed, a decimal point.
+     */
+    static bool is_plain_number(const CSVCell &cell, bool decimals) {
+        size_t i = 0;
+        if (cell.size > 0 && (cell.data[0] == '-' || cell.data[0] == '+')) ++i;
+        size_t digits = 0;
+        bool point = false;
+        for (; i < cell.size; ++i) {
+            char c = cell.data[i];
+            if (c >= '0' && c <= '9') {
+                ++digits;
+            } else if (c == '.' && decimals && !point) {
+                point = true;
+            } else {
+                return false;
+            }
+        }
+        return digits > 0;
+    };
+    /**
+     * Parse the WKT of a row, the program stops if it is malformed. A row
+     * without the geometry column gets a null geometry.
+     */
+    void parse_geometry(const CSVRow &row, FlatGeometry &geom) {
+        if (geom_idx >= row.size()) {
+            geom.clear();
+            return;
+        }
+        const CSVCell &cell = row[geom_idx];
+        WKTParser parser;
+        if (!parser.parse(cell.data, cell.data + cell.size, geom)) {
+            std::cerr << "--- Error, invalid WKT at row " << reader.locate_row(cell.data)
+                      << " column " << parser.get_error_offset() + 1 << ": "
+                      << parser.get_error() << std::endl;
+            std::cerr << "    " << cell.str() << std::endl;
+            std::cerr << "Program stops unexpectedly" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    };
+    /**
+     * Build the OGR geometry of a parsed WKT
+     */
+    static OGRGeometry *to_ogr_geometry(const FlatGeometry &geom) {
+        int npoints = geom.num_points();
+        switch (geom.geom_type_idx) {
+        case 0:
+            if (npoints == 0) return new OGRPoint();
+            return new OGRPoint(geom.xy[0], geom.xy[1]);
+        case 1: {
+            OGRLineString *line = new OGRLineString();
+            if (npoints > 0) set_points(line, geom, 0);
+            return line;
+        }
+        case 2: {
+            OGRPolygon *polygon = new OGRPolygon();
+            for (int k = 0; k < geom.parts.size(); ++k) {
+                OGRLinearRing *ring = new OGRLinearRing();
+                set_points(ring, geom, k);
+                polygon->addRingDirectly(ring);
+            }
+            return polygon;
+        }
+        case 3: {
+            OGRMultiPoint *multipoint = new OGRMultiPoint();
+            for (int i = 0; i < npoints; ++i) {
+                multipoint->addGeometryDirectly(new OGRPoint(geom.xy[2 * i], geom.xy[2 * i + 1]));
+            }
+            return multipoint;
+        }
+        case 4: {
+            OGRMultiLineString *multiline = new OGRMultiLineString();
+            for (int k = 0; k < geom.parts.size(); ++k) {
+                OGRLineString *line = new OGRLineString();
+                set_points(line, geom, k);
+                multiline->addGeometryDirectly(line);
+            }
+            return multiline;
+        }
+        default: {
+            OGRMultiPolygon *multipolygon = new OGRMultiPolygon();
+            OGRPolygon *polygon = NULL;
+            for (int k = 0; k < geom.parts.size(); ++k) {
+                if (geom.outer[k]) {
+                    if (polygon != NULL) multipolygon->addGeometryDirectly(polygon);
+                    polygon = new OGRPolygon();
+                }
+                OGRLinearRing *ring = new OGRLinearRing();
+                set_points(ring, geom, k);
+                polygon->addRingDirectly(ring);
+            }
+            if (polygon != NULL) multipolygon->addGeometryDirectly(polygon);
+            return multipolygon;
+        }
+        }
+    };
+    /**
+     * Copy the points of a part, the interleaved coordinates have the same
+     * layout as OGRRawPoint.
+     */
+    static void set_points(OGRSimpleCurve *curve, const FlatGeometry &geom, int part) {
+        int begin = geom.parts.empty() ? 0 : geom.parts[part];
+        int end = part + 1 < geom.parts.size() ? geom.parts[part + 1] : geom.num_points();
+        curve->setPoints(end - begin, reinterpret_cast<const OGRRawPoint *>(&geom.xy[2 * begin]));
+    };
+    /**
+     * Scratch string used to pass a cell to GDAL as a C string, it is reused
+     * so that no allocation happens once it is large enough.
+     */
+    static std::string &cell_buffer() {
+        static thread_local std::string buffer;
+        return buffer;
+    };
+    /**
+     * Convert a cell to an integer, a decimal number is truncated.
+     * @return false if the cell is not a number
+     */
+    static bool cell_to_long(const CSVCell &cell, long long *value) {
+        int64_t ivalue;
+        if (NumberParser::parse_int64(cell.data, cell.data + cell.size, &ivalue) == NUMBER_OK) {
+            *value = ivalue;
+            return true;
+        }
+        double dvalue;
+        if (!cell_to_double(cell, &dvalue)) return false;
+        *value = static_cast<long long>(dvalue);
+        return true;
+    };
+    static bool cell_to_double(const CSVCell &cell, double *value) {
+        return NumberParser::parse_double(cell.data, cell.data + cell.size, value) == NUMBER_OK;
+    };
+    /**
+     * Center of the bounding box of the geometry of a row
+     * @return false if the geometry is empty
+     */
+    template <class Timer>
+    bool get_center(const CSVRow &row, double *x, double *y, Timer &timer) {
+        if (conf.mode_xy) {
+            *x = parse_coordinate(row, x_idx);
+            *y = parse_coordinate(row, y_idx);
+            timer.lap(STAGE_NUMERIC_PARSE);
+            return true;
+        }
+        static thread_local FlatGeometry geom;
+        parse_geometry(row, geom);
+        timer.lap(STAGE_WKT_PARSE);
+        if (geom.num_points() == 0) return false;
+        BoundingBox box;
+        for (int i = 0; i < geom.num_points(); ++i) {
+            box.extend(geom.xy[2 * i], geom.xy[2 * i + 1], geom.xy[2 * i], geom.xy[2 * i + 1]);
+        }
+        *x = (box.minx + box.maxx) / 2;
+        *y = (box.miny + box.maxy) / 2;
+        return true;
+    };
+    /**
+     * Convert the x or y cell of a row, the program stops if it is missing
+     * or not a number.
+     */
+    double parse_coordinate(const CSVRow &row, int idx) {
+        if (idx >= row.size()) {
+            std::cerr << "--- Error, missing coordinate at row " << reader.locate_row(row[0].data) << std::endl;
+            std::cerr << "Program stops unexpectedly" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        const CSVCell &cell = row[idx];
+        double value;
+        if (!cell_to_double(cell, &value)) {
+            std::cerr << "--- Error, invalid coordinate at row " << reader.locate_row(cell.data)
+                      << ": " << cell.str() << std::endl;
+            std::cerr << "Program stops unexpectedly" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return value;
+    };
+    std::vector<OGRwkbGeometryType> ogrtypes = {wkbPoint, wkbLineString, wkbPolygon, wkbMultiPoint, wkbMultiLineString, wkbMultiPolygon};
+    std::vector<int> native_shape_types = {
+        NativeShapefile::SHP_POINT, NativeShapefile::SHP_POLYLINE, NativeShapefile::SHP_POLYGON,
+        NativeShapefile::SHP_MULTIPOINT, NativeShapefile::SHP_POLYLINE, NativeShapefile::SHP_POLYGON
+    };
+    static const size_t batch_size = 4096;
+    bool use_native = false;
+    int native_record_size = 1;
+    OutputSchema schema;
+    ShardWriter *shard = NULL; // shard written by write_batch
+    std::vector<ShardInfo> shards; // shards closed so far
+    FeatureBatch pending; // rows written by write_data
+    CSVConfig &conf;
+    CSVReader &reader;
+    int x_idx = -1;
+    int y_idx = -1;
+    int geom_idx = -1;
+    std::vector<int> csv_field_indices;
+    std::vector<int> csv_column_types;
+    std::vector<ColumnStats> column_stats;
+    ConversionPlan plan;
+}; // SHPWriter
+
+/**
+ * Convert the rows of a mapped input with several threads. The data is split
+ * into chunks at line breaks, worker threads create the features of a chunk
+ * and the calling thread writes the chunks to the layer in the original
+ * order, so the output is the same as writing the rows one by one.
+ */
+class ParallelConverter {
+public:
+    ParallelConverter(CSVReader &reader, SHPWriter &_writer, int _threads):
+        writer(_writer), threads(_threads), scanner(reader.get_scanner()) {
+        const char *begin;
+        const char *end;
+        reader.get_remaining_range(&begin, &end);
+        range_begin = begin;
+        range_size = end - begin;
+        std::vector<std::pair<const char *, const char *> > ranges = scanner.split_range(begin, end, chunk_size);
+        chunks = std::vector<Chunk>(ranges.size());
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            chunks[i].begin = ranges[i].first;
+            chunks[i].end = ranges[i].second;
+        }
+        // Limit the number of chunks held in memory
+        window = 4 * threads;
+    };
+    /**
+     * Run the conversion, the time of the stages of all threads is added
+     * to stats and progress is reported if it is not NULL.
+     * @return number of features written
+     */
+    template <class Timer>
+    long long run(StageStats &stats, Progress *progress) {
+        std::vector<std::thread> workers;
+        for (int i = 0; i < threads; ++i) {
+            workers.push_back(std::thread(&ParallelConverter::work<Timer>, this, &stats));
+        }
+        StageStats write_stats;
+        Timer timer(&write_stats);
+        long long features = 0;
+        for (size_t idx = 0; idx < chunks.size(); ++idx) {
+            Chunk &chunk = chunks[idx];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                chunk_ready.wait(lock, [&chunk] { return chunk.ready; });
+            }
+            features += chunk.batch.size;
+            timer.start();
+            writer.write_batch(chunk.batch, timer);
+            // Release the memory of the chunk
+            chunk.batch = FeatureBatch();
+            if (progress != NULL) {
+                long long bytes = chunk.end - range_begin;
+                progress->report(features, bytes, static_cast<double>(bytes) / range_size);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                written = idx + 1;
+            }
+            chunk_written.notify_all();
+        }
+        for (size_t i = 0; i < workers.size(); ++i) {
+            workers[i].join();
+        }
+        stats.merge(write_stats);
+        return features;
+    };
+private:
+    struct Chunk {
+        const char *begin;
+        const char *end;
+        FeatureBatch batch;
+        bool ready = false;
+    };
+    template <class Timer>
+    void work(StageStats *stats) {
+        CSVRow row;
+        StageStats local_stats;
+        Timer timer(&local_stats);
+        while (true) {
+            size_t idx;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                idx = next_chunk++;
+                if (idx >= chunks.size()) {
+                    stats->merge(local_stats);
+                    return;
+                }
+                chunk_written.wait(lock, [this, idx] { return idx < written + window; });
+            }
+            Chunk &chunk = chunks[idx];
+            CSVScanner::Cursor cursor(&scanner, chunk.begin, chunk.end);
+            const char *line_begin;
+            const char *line_end;
+            timer.start();
+            while (true) {
+                row.clear();
+                if (!cursor.next_row(row, &line_begin, &line_end)) break;
+                timer.lap(STAGE_SPLIT);
+                writer.add_to_batch(row, chunk.batch, timer);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                chunk.ready = true;
+            }
+            chunk_ready.notify_all();
+        }
+    };
+    static const size_t chunk_size = 4 << 20; // 4MB
+    SHPWriter &writer;
+    int threads;
+    CSVScanner scanner;
+    const char *range_begin; // input converted, for progress reports
+    size_t range_size;
+    std::vector<Chunk> chunks;
+    size_t window;
+    size_t next_chunk = 0; // next chunk to be processed by a worker
+    size_t written = 0; // number of chunks written
+    std::mutex mutex;
+    std::condition_variable chunk_ready;
+    std::condition_variable chunk_written;
+}; // ParallelConverter
+
+/**
+ * Writes the shards of the output concurrently, each one from its own
+ * range of the input. It is used when the number of rows of a shard is
+ * known before the rows are converted.
+ */
+class ShardedConverter {
+public:
+    ShardedConverter(CSVReader &reader, SHPWriter &_writer, int _threads, long long _shard_rows,
+                     const std::vector<std::pair<const char *, const char *> > &_ranges):
+        writer(_writer), threads(_threads), shard_rows(_shard_rows), ranges(_ranges),
+        scanner(reader.get_scanner()) {
+        infos = std::vector<ShardInfo>(ranges.size());
+    };
+    /**
+     * Run the conversion
+     * @return number of features written
+     */
+    template <class Timer>
+    long long run(StageStats &stats, Progress *_progress) {
+        std::cerr << "Write " << ranges.size() << " shards with " << threads << " threads" << std::endl;
+        progress = _progress;
+        std::vector<std::thread> workers;
+        for (int i = 0; i < threads && i < ranges.size(); ++i) {
+            workers.push_back(std::thread(&ShardedConverter::work<Timer>, this, &stats));
+        }
+        for (size_t i = 0; i < workers.size(); ++i) {
+            workers[i].join();
+        }
+        long long features = 0;
+        for (size_t i = 0; i < infos.size(); ++i) features += infos[i].rows;
+        writer.add_shards(infos);
+        return features;
+    };
+private:
+    template <class Timer>
+    void work(StageStats *stats) {
+        CSVRow row;
+        FeatureBatch batch;
+        StageStats local_stats;
+        Timer timer(&local_stats);
+        while (true) {
+            size_t idx;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                idx = next_shard++;
+                if (idx >= ranges.size()) {
+                    stats->merge(local_stats);
+                    return;
+                }
+            }
+            ShardWriter shard(writer.get_schema(), writer.shard_path(idx + 1), idx * shard_rows + 1);
+            CSVScanner::Cursor cursor(&scanner, ranges[idx].first, ranges[idx].second);
+            const char *line_begin;
+            const char *line_end;
+            const char *reported = ranges[idx].first;
+            timer.start();
+            while (true) {
+                row.clear();
+                if (!cursor.next_row(row, &line_begin, &line_end)) break;
+                timer.lap(STAGE_SPLIT);
+                writer.add_to_batch(row, batch, timer);
+                if (batch.size >= batch_size) {
+                    if (progress != NULL) report_progress(batch.size, cursor.position() - reported);
+                    reported = cursor.position();
+                    writer.write_to_shard(shard, batch, timer);
+                }
+            }
+            if (progress != NULL) report_progress(batch.size, cursor.position() - reported);
+            writer.write_to_shard(shard, batch, timer);
+            shard.close();
+            timer.lap(STAGE_FLUSH);
+            infos[idx] = shard.get_info();
+        }
+    };
+    /**
+     * Add the rows and bytes of a batch to the progress of all the shards
+     */
+    void report_progress(long long rows, long long bytes) {
+        long long total_rows = rows_done.fetch_add(rows) + rows;
+        long long total_bytes = bytes_done.fetch_add(bytes) + bytes;
+        progress->report(total_rows, total_bytes, static_cast<double>(total_bytes) / (ranges.back().second - ranges.front().first));
+    };
+    static const size_t batch_size = 4096;
+    SHPWriter &writer;
+    int threads;
+    Progress *progress = NULL;
+    std::atomic<long long> rows_done{0};
+    std::atomic<long long> bytes_done{0};
+    long long shard_rows;
+    std::vector<std::pair<const char *, const char *> > ranges;
+    CSVScanner scanner;
+    std::vector<ShardInfo> infos;
+    size_t next_shard = 0;
+    std::mutex mutex;
+}; // ShardedConverter
+
+/**
+ * Temporary file, removed as soon as it is created, that is appended to
+ * through a buffer and read at any offset.
+ */
+class TempFile {
+public:
+    TempFile() {
+        const char *dir = getenv("TMPDIR");
+        std::string pattern = std::string(dir != NULL && *dir ? dir : "/tmp") + "/csv2shp_XXXXXX";
+        std::vector<char> name(pattern.begin(), pattern.end());
+        name.push_back('\0');
+        fd = mkstemp(name.data());
+        if (fd < 0) fail("cannot create temporary file");
+        unlink(name.data());
+    };
+    ~TempFile() {
+        ::close(fd);
+    };
+    void append(const void *data, size_t n) {
+        const char *p = static_cast<const char *>(data);
+        if (buffer.size() + n > (1 << 20)) flush();
+        if (n > (1 << 20)) {
+            write_at(p, n, written);
+            written += n;
+            return;
+        }
+        buffer.insert(buffer.end(), p, p + n);
+    };
+    void flush() {
+        write_at(buffer.data(), buffer.size(), written);
+        written += buffer.size();
+        buffer.clear();
+    };
+    /**
+     * Read n bytes at offset, which have been flushed
+     */
+    void read_at(uint64_t offset, void *data, size_t n) {
+        char *p = static_cast<char *>(data);
+        while (n > 0) {
+            ssize_t r = pread(fd, p, n, offset);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) fail("cannot read temporary file");
+            p += r;
+            n -= r;
+            offset += r;
+        }
+    };
+    uint64_t size() const {
+        return written + buffer.size();
+    };
+private:
+    void write_at(const char *p, size_t n, uint64_t offset) {
+        while (n > 0) {
+            ssize_t r = pwrite(fd, p, n, offset);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) fail("cannot write temporary file");
+            p += r;
+            n -= r;
+            offset += r;
+        }
+    };
+    static void fail(const std::string &message) {
+        std::cerr << "--- Error, " << message << ": " << strerror(errno) << std::endl;
+        std::cerr << "Program stops unexpectedly" << std::endl;
+        exit(EXIT_FAILURE);
+    };
+    int fd = -1;
+    uint64_t written = 0;
+    std::vector<char> buffer;
+};
+
+/**
+ * Writes the features ordered along a Hilbert curve over the extent of the
+ * data, so that features close in space are close in the output. The rows
+ * are read once, keeping the center of each geometry and the position of
+ * the row: in the mapped input, or in a temporary copy for a stream. The
+ * entries are sorted in memory, or in sorted runs on disk merged at the
+ * end when they do not fit in the memory budget.
+ */
+class HilbertSorter {
+public:
+    HilbertSorter(CSVReader &_reader, SHPWriter &_writer):
+        reader(_reader), writer(_writer), scanner(reader.get_scanner()) {};
+    /**
+     * Run the conversion. The time of sorting is not part of the stages
+     * added to stats.
+     * @return number of features written
+     */
+    template <class Timer>
+    long long run(StageStats &stats, Progress *_progress) {
+        progress = _progress;
+        Timer timer(&stats);
+        collect(timer);
+        if (spilled_entries == 0) {
+            compute_keys(entries.data(), entries.size());
+            std::sort(entries.begin(), entries.end(), less);
+            start_writing();
+            timer.start();
+            for (size_t i = 0; i < entries.size(); ++i) write_row(entries[i], timer);
+            return entries.size();
+        }
+        sort_runs();
+        start_writing();
+        return merge_runs(timer);
+    };
+private:
+    struct Entry {
+        double x; // center of the geometry, NaN if it is empty
+        double y;
+        uint64_t key; // position on the Hilbert curve
+        uint64_t offset; // position of the row in the input or copy
+        uint64_t length;
+    };
+    static bool less(const Entry &a, const Entry &b) {
+        return a.key < b.key || (a.key == b.key && a.offset < b.offset);
+    };
+    /**
+     * Read the rows, the entries beyond the memory budget are spilled to
+     * disk before they can be sorted since the extent is not known yet.
+     */
+    template <class Timer>
+    void collect(Timer &timer) {
+        const char *end;
+        mapped = reader.get_remaining_range(&base, &end);
+        CSVRow row;
+        const char *line_begin;
+        const char *line_end;
+        while (true) {
+            row.clear();
+            if (!reader.next_row(row, &line_begin, &line_end, timer)) break;
+            if (row.empty()) continue;
+            Entry entry;
+            if (writer.get_center(row, &entry.x, &entry.y, timer)) {
+                extent.extend(entry.x, entry.y, entry.x, entry.y);
+            } else {
+                entry.x = entry.y = NAN;
+            }
+            entry.key = 0;
+            entry.length = line_end - line_begin;
+            if (mapped) {
+                entry.offset = line_begin - base;
+            } else {
+                entry.offset = rows.size();
+                rows.append(line_begin, entry.length);
+            }
+            entries.push_back(entry);
+            ++total_rows;
+            if (progress != NULL && total_rows % 4096 == 0) {
+                long long bytes;
+                double fraction = reader.get_progress(&bytes);
+                progress->report(total_rows, bytes, fraction);
+            }
+            if (entries.size() == max_entries) {
+                spill.append(entries.data(), entries.size() * sizeof(Entry));
+                spilled_entries += entries.size();
+                entries.clear();
+            }
+        }
+        if (spilled_entries > 0 && !entries.empty()) {
+            spill.append(entries.data(), entries.size() * sizeof(Entry));
+            spilled_entries += entries.size();
+            entries.clear();
+        }
+        if (!mapped) rows.flush();
+        spill.flush();
+        std::cerr << "Sort " << spilled_entries + entries.size() << " rows along a Hilbert curve" << std::endl;
+    };
+    /**
+     * Sort the spilled entries in runs of max_entries
+     */
+    void sort_runs() {
+        for (uint64_t first = 0; first < spilled_entries; first += max_entries) {
+            size_t n = std::min<uint64_t>(max_entries, spilled_entries - first);
+            entries.resize(n);
+            spill.read_at(first * sizeof(Entry), entries.data(), n * sizeof(Entry));
+            compute_keys(entries.data(), n);
+            std::sort(entries.begin(), entries.end(), less);
+            sorted.append(entries.data(), n * sizeof(Entry));
+            run_sizes.push_back(n);
+        }
+        sorted.flush();
+        std::vector<Entry>().swap(entries);
+    };
+    template <class Timer>
+    long long merge_runs(Timer &timer) {
+        struct Cursor {
+            uint64_t next; // next entry of the run to read
+            uint64_t end;
+            std::vector<Entry> buffer;
+            size_t pos;
+        };
+        const size_t cursor_entries = 1 << 14;
+        std::vector<Cursor> cursors(run_sizes.size());
+        uint64_t first = 0;
+        for (size_t r = 0; r < run_sizes.size(); ++r) {
+            cursors[r].next = first;
+            cursors[r].end = first + run_sizes[r];
+            cursors[r].pos = 0;
+            first += run_sizes[r];
+        }
+        // Heap of the current entry of each run, smallest first
+        std::vector<std::pair<Entry, size_t> > heap;
+        auto greater = [](const std::pair<Entry, size_t> &a, const std::pair<Entry, size_t> &b) {
+            return less(b.first, a.first);
+        };
+        auto advance = [&](size_t r) {
+            Cursor &c = cursors[r];
+            if (c.pos == c.buffer.size()) {
+                size_t n = std::min<uint64_t>(cursor_entries, c.end - c.next);
+                c.buffer.resize(n);
+                if (n > 0) sorted.read_at(c.next * sizeof(Entry), c.buffer.data(), n * sizeof(Entry));
+                c.next += n;
+                c.pos = 0;
+                if (n == 0) return;
+            }
+            heap.push_back(std::make_pair(c.buffer[c.pos++], r));
+            std::push_heap(heap.begin(), heap.end(), greater);
+        };
+        for (size_t r = 0; r < cursors.size(); ++r) advance(r);
+        timer.start();
+        long long features = 0;
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), greater);
+            std::pair<Entry, size_t> top = heap.back();
+            heap.pop_back();
+            write_row(top.first, timer);
+            ++features;
+            advance(top.second);
+        }
+        return features;
+    };
+    void compute_keys(Entry *e, size_t n) {
+        double width = extent.maxx - extent.minx;
+        double height = extent.maxy - extent.miny;
+        for (size_t i = 0; i < n; ++i) {
+            if (e[i].x != e[i].x) {
+                // Empty geometries go last
+                e[i].key = UINT64_MAX;
+                continue;
+            }
+            uint32_t x = width > 0 ? static_cast<uint32_t>((e[i].x - extent.minx) / width * 4294967295.0) : 0;
+            uint32_t y = height > 0 ? static_cast<uint32_t>((e[i].y - extent.miny) / height * 4294967295.0) : 0;
+            e[i].key = hilbert_key(x, y);
+        }
+    };
+    /**
+     * Distance along a Hilbert curve filling a 2^32 x 2^32 grid
+     */
+    static uint64_t hilbert_key(uint32_t x, uint32_t y) {
+        uint64_t d = 0;
+        for (uint32_t s = 1u << 31; s > 0; s >>= 1) {
+            uint32_t rx = (x & s) ? 1 : 0;
+            uint32_t ry = (y & s) ? 1 : 0;
+            d += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+            if (ry == 0) {
+                if (rx == 1) {
+                    x = ~x;
+                    y = ~y;
+                }
+                std::swap(x, y);
+            }
+        }
+        return d;
+    };
+    template <class Timer>
+    void write_row(const Entry &entry, Timer &timer) {
+        const char *line;
+        if (mapped) {
+            line = base + entry.offset;
+        } else {
+            line_buffer.resize(entry.length);
+            if (entry.length > 0) rows.read_at(entry.offset, line_buffer.data(), entry.length);
+            line = line_buffer.data();
+        }
+        row.clear();
+        timer.lap(STAGE_READ);
+        scanner.split_line(line, line + entry.length, row);
+        timer.lap(STAGE_SPLIT);
+        writer.write_data(row, timer);
+        ++rows_written;
+        if (progress != NULL && rows_written % 4096 == 0) {
+            progress->report(rows_written, input_bytes, static_cast<double>(rows_written) / total_rows);
+        }
+    };
+    /**
+     * Start the progress of writing the sorted rows
+     */
+    void start_writing() {
+        if (progress == NULL) return;
+        reader.get_progress(&input_bytes);
+        progress->start_phase(0, input_bytes);
+    };
+    static const size_t max_entries = (256 << 20) / sizeof(Entry); // 256MB of entries in memory
+    CSVReader &reader;
+    SHPWriter &writer;
+    CSVScanner scanner;
+    bool mapped = false;
+    const char *base = NULL; // mapped input
+    TempFile rows; // copy of the rows of a stream
+    TempFile spill; // entries beyond the memory budget, unsorted
+    TempFile sorted; // runs of sorted entries
+    std::vector<uint64_t> run_sizes;
+    std::vector<Entry> entries;
+    uint64_t spilled_entries = 0;
+    long long total_rows = 0;
+    long long rows_written = 0;
+    long long input_bytes = 0;
+    Progress *progress = NULL;
+    BoundingBox extent;
+    CSVRow row;
+    std::vector<char> line_buffer;
+}; // HilbertSorter
+
+void print_help()
+{
+    std::cout << "Usage: csv2shp -i INPUT_FILE -m XY|WKT (-x X_COLUMN_NAME, -y Y_COLUMN_NAME|-g GEOM_COLUMN) [-d ';'] [-j N] [-w gdal|native] [-s all|N] [--max-rows N] [--max-bytes N] [--spatial-index] [--sort hilbert] [--stats[=SECONDS]] [--stats-json FILE] -o output_file" << std::endl;
+    std::cout << "Arguments: " << std::endl;
+    std::cout << "-i (required): input file, - for stdin, gzip or zstd compressed input is detected" << std::endl;
+    std::cout << "-o (required): output file" << std::endl;
+    std::cout << "-m (required): mode (xy or wkt)" << std::endl;
+    std::cout << "-g (optional): geometry column name or idx starting from 0 (Default:'geom')" << std::endl;
+    std::cout << "-x (optional): x column name or idx starting from 0 (Default:'x')" << std::endl;
+    std::cout << "-y (optional): y column name or idx starting from 0 (Default:'y')" << std::endl;
+    std::cout << "-d (optional): delimiter of CSV file (Default: ';')" << std::endl;
+    std::cout << "-H (optional): with header (t or f) (Default: 't')" << std::endl;
+    std::cout << "-j (optional): number of threads used to create features (Default: 1)" << std::endl;
+    std::cout << "-w (optional): shapefile writer, gdal or native (Default: 'gdal')" << std::endl;
+    std::cout << "-s (optional): number of rows scanned to infer column types and field widths, all for the whole file (Default: 1)" << std::endl;
+    std::cout << "--max-rows (optional): maximum number of rows of an output shard" << std::endl;
+    std::cout << "--max-bytes (optional): maximum size of the .shp and .dbf files of a shard, with an optional K, M or G suffix (Default: 2G)" << std::endl;
+    std::cout << "--spatial-index (optional): write a .qix quadtree index with each shapefile" << std::endl;
+    std::cout << "--sort (optional): hilbert to write the features ordered along a Hilbert curve" << std::endl;
+    std::cout << "--stats (optional): print progress every SECONDS (Default: 5) and the time of each stage on stderr" << std::endl;
+    std::cout << "--stats-json (optional): file to write the throughput, peak memory and time of each stage of the conversion as JSON" << std::endl;
+    std::cout << "-h: help information" << std::endl;
+};
+
+/**
+ * Parse a size with an optional K, M or G suffix
+ * @return the size in bytes, -1 if it is invalid
+ */
+long long parse_size(const std::string &s)
+{
+    char *end;
+    long long value = strtoll(s.c_str(), &end, 10);
+    if (end == s.c_str() || value < 0) return -1;
+    std::string suffix(end);
+    if (suffix == "K" || suffix == "k") return value << 10;
+    if (suffix == "M" || suffix == "m") return value << 20;
+    if (suffix == "G" || suffix == "g") return value << 30;
+    return suffix.empty() ? value : -1;
+};
+
+/**
+ * Check if a file exists or not
+ * @param  filename
+ * @return
+ */
+bool fileExists(std::string &filename)
+{
+    const char *filename_c_str = filename.c_str();
+    struct stat buf;
+    if (stat(filename_c_str, &buf) != -1)
+    {
+        return true;
+    }
+    return false;
+};
+
+void print_config(CSVConfig &conf){
+    std::cerr << "Config information" << std::endl;
+    std::cerr << "    Input file: " << conf.input_file << std::endl;
+    std::cerr << "    Output file: " << conf.output_file << std::endl;
+    std::cerr << "    Mode: " << (conf.mode_xy?"xy":"wkt") << std::endl;
+    if (conf.mode_xy) {
+        std::cerr << "    x column or idx:" << conf.x_column << std::endl;
+        std::cerr << "    y column or idx:" << conf.y_column << std::endl;
+    } else {
+        std::cerr << "    wkt geom column or idx: " << conf.geom_column << std::endl;
+    }
+    std::cerr << "    Delimiter: " << conf.delimiter << std::endl;
+    std::cerr << "    With header: " << (conf.hasHeader?"t":"f") << std::endl;
+    std::cerr << "    Threads: " << conf.threads << std::endl;
+    std::cerr << "    Writer: " << (conf.native_writer?"native":"gdal") << std::endl;
+    std::cerr << "    Rows scanned for types: " << (conf.scan_rows == 0 ? std::string("all") : std::to_string(conf.scan_rows)) << std::endl;
+    if (conf.max_rows > 0) std::cerr << "    Max rows of a shard: " << conf.max_rows << std::endl;
+    if (conf.max_bytes > 0) std::cerr << "    Max bytes of a shard: " << conf.max_bytes << std::endl;
+    if (conf.spatial_index) std::cerr << "    Spatial index: qix" << std::endl;
+    if (conf.sort_hilbert) std::cerr << "    Sort: hilbert" << std::endl;
+    if (conf.stats) std::cerr << "    Progress every " << conf.progress_interval << " seconds" << std::endl;
+    if (!conf.stats_json.empty()) std::cerr << "    Statistics: " << conf.stats_json << std::endl;
+};
+
+/**
+ * Convert the rows of the reader with the strategy given by the
+ * configuration and close the writer. The timer type is NoTimer unless
+ * statistics are requested, progress is reported if it is not NULL.
+ * @return number of features written
+ */
+template <class Timer>
+long long convert(CSVConfig &conf, CSVReader &reader, SHPWriter &writer, StageStats &stats, Progress *progress)
+{
+    long long features = 0;
+    const char *begin;
+    const char *end;
+    if (conf.sort_hilbert) {
+        HilbertSorter sorter(reader, writer);
+        features = sorter.run<Timer>(stats, progress);
+    } else if (conf.threads > 1 && reader.get_remaining_range(&begin, &end)) {
+        long long shard_rows = writer.get_shard_rows();
+        std::vector<std::pair<const char *, const char *> > shard_ranges;
+        if (shard_rows > 0) shard_ranges = reader.get_scanner().split_rows(begin, end, shard_rows);
+        if (shard_ranges.size() > 1) {
+            ShardedConverter converter(reader, writer, conf.threads, shard_rows, shard_ranges);
+            features = converter.run<Timer>(stats, progress);
+        } else {
+            ParallelConverter converter(reader, writer, conf.threads);
+            features = converter.run<Timer>(stats, progress);
+        }
+    } else {
+        Timer timer(&stats);
+        CSVRow row;
+        const char *line_begin;
+        const char *line_end;
+        while (true) {
+            row.clear();
+            if (!reader.next_row(row, &line_begin, &line_end, timer)) break;
+            if (!writer.write_data(row, timer)) continue;
+            ++features;
+            if (progress != NULL && features % 4096 == 0) {
+                long long bytes;
+                double fraction = reader.get_progress(&bytes);
+                progress->report(features, bytes, fraction);
+            }
+        }
+    }
+    Timer timer(&stats);
+    writer.close(timer);
+    return features;
+};
+
+/**
+ * Print the time and count of each stage and the throughput of a run
+ */
+void print_stats(CSVReader &reader, long long features, const StageStats &stats, const TickRate &rate)
+{
+    double seconds = rate.elapsed_seconds();
+    long long input_bytes = reader.get_input_bytes();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "Statistics\n");
+    fprintf(stderr, "    %-16s %12s %14s\n", "Stage", "Seconds", "Count");
+    for (int i = 0; i < NUM_STAGES; ++i) {
+        fprintf(stderr, "    %-16s %12.3f %14llu\n", STAGE_NAMES[i], rate.seconds(stats.ticks[i]),
+                (unsigned long long) stats.counts[i]);
+    }
+    fprintf(stderr, "    %lld features in %.3f s, %.0f rows/s, %.1f MB/s, peak RSS %.1f MB\n", features, seconds,
+            seconds > 0 ? features / seconds : 0.0, seconds > 0 ? input_bytes / seconds / 1048576.0 : 0.0,
+            usage.ru_maxrss / 1024.0);
+};
+
+/**
+ * Write the statistics of a run as JSON. The keys and their order are
+ * stable so that results can be compared between versions.
+ */
+void write_stats_json(CSVConfig &conf, CSVReader &reader, long long features, double setup_seconds,
+                      const StageStats &stats, const TickRate &rate)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double seconds = rate.elapsed_seconds();
+    long long input_bytes = reader.get_input_bytes();
+    std::string input = conf.input_file;
+    std::string output = conf.output_file;
+    FILE *out = fopen(conf.stats_json.c_str(), "w");
+    if (out == NULL) {
+        std::cerr << "--- Error, cannot write statistics to " << conf.stats_json << ": " << strerror(errno) << std::endl;
+        std::cerr << "Program stops unexpectedly" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    fprintf(out, "{\n");
+    fprintf(out, "  \"format\": \"csv2shp-stats/1\",\n");
+    fprintf(out, "  \"input\": \"%s\",\n", SHPWriter::json_escape(input).c_str());
+    fprintf(out, "  \"output\": \"%s\",\n", SHPWriter::json_escape(output).c_str());
+    fprintf(out, "  \"mode\": \"%s\",\n", conf.mode_xy ? "xy" : "wkt");
+    fprintf(out, "  \"writer\": \"%s\",\n", conf.native_writer ? "native" : "gdal");
+    fprintf(out, "  \"threads\": %d,\n", conf.threads);
+    fprintf(out, "  \"input_bytes\": %lld,\n", input_bytes);
+    fprintf(out, "  \"features\": %lld,\n", features);
+    fprintf(out, "  \"seconds\": %.6f,\n", seconds);
+    fprintf(out, "  \"setup_seconds\": %.6f,\n", setup_seconds);
+    fprintf(out, "  \"rows_per_second\": %.1f,\n", seconds > 0 ? features / seconds : 0.0);
+    fprintf(out, "  \"mb_per_second\": %.3f,\n", seconds > 0 ? input_bytes / seconds / (1 << 20) : 0.0);
+    fprintf(out, "  \"peak_rss_kb\": %ld,\n", usage.ru_maxrss);
+    fprintf(out, "  \"stages\": {\n");
+    for (int i = 0; i < NUM_STAGES; ++i) {
+        fprintf(out, "    \"%s\": {\"seconds\": %.6f, \"count\": %llu}%s\n", STAGE_NAMES[i],
+                rate.seconds(stats.ticks[i]), (unsigned long long) stats.counts[i], i + 1 < NUM_STAGES ? "," : "");
+    }
+    fprintf(out, "  }\n}\n");
+    if (fclose(out) != 0) {
+        std::cerr << "--- Error, cannot write statistics to " << conf.stats_json << std::endl;
+        std::cerr << "Program stops unexpectedly" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::cerr << "Statistics written to " << conf.stats_json << std::endl;
+};
+
+int main (int argc, char **argv)
+{
+    std::cerr << "--------- csv2shp ---------" << std::endl;
+    std::cerr << "---- Author: Can Yang  ----" << std::endl;
+    CSVConfig conf;
+    // std::string input_file;
     // std::string output_file;
     // std::string x_column = "x";
     // std::string y_column = "y";
@@ -466,6 +3232,14 @@ int main (int argc, char **argv)
     // char delimiter = ';';
     std::string mode;
     std::string header_flag = "t";
+    std::string writer_name = "gdal";
+    std::string scan_flag = "1";
+    std::string max_rows_flag;
+    std::string max_bytes_flag;
+    // Options without a short name
+    std::string sort_flag;
+    std::string stats_flag;
+    enum { OPT_MAX_ROWS = 256, OPT_MAX_BYTES, OPT_SORT, OPT_SPATIAL_INDEX, OPT_STATS, OPT_STATS_JSON };
     // bool xy = false;
     // bool wkt = false;
     // 0 or all patterns, 1 for closed pattern, 2 maximal pattern
@@ -482,10 +3256,19 @@ int main (int argc, char **argv)
         {"ycol",   required_argument, 0, 'y' },
         {"geom",   required_argument, 0, 'g' },
         {"header",   required_argument, 0, 'H' },
+        {"threads",   required_argument, 0, 'j' },
+        {"writer",   required_argument, 0, 'w' },
+        {"scan",   required_argument, 0, 's' },
+        {"max-rows",   required_argument, 0, OPT_MAX_ROWS },
+        {"max-bytes",   required_argument, 0, OPT_MAX_BYTES },
+        {"sort",   required_argument, 0, OPT_SORT },
+        {"spatial-index",   no_argument, 0, OPT_SPATIAL_INDEX },
+        {"stats",   optional_argument, 0, OPT_STATS },
+        {"stats-json",   required_argument, 0, OPT_STATS_JSON },
         {0,         0,                 0,  0 }
     };
     int long_index = 0;
-    while ((opt = getopt_long(argc, argv, "i:o:m:x:y:g:d:H:h",
+    while ((opt = getopt_long(argc, argv, "i:o:m:x:y:g:d:H:j:w:s:h",
                               long_options, &long_index )) != -1)
     {
         switch (opt)
@@ -514,6 +3297,34 @@ int main (int argc, char **argv)
         case 'H' :
             header_flag = std::string(optarg);
             break;
+        case 'j' :
+            conf.threads = atoi(optarg);
+            break;
+        case 'w' :
+            writer_name = std::string(optarg);
+            break;
+        case 's' :
+            scan_flag = std::string(optarg);
+            break;
+        case OPT_MAX_ROWS :
+            max_rows_flag = std::string(optarg);
+            break;
+        case OPT_MAX_BYTES :
+            max_bytes_flag = std::string(optarg);
+            break;
+        case OPT_SORT :
+            sort_flag = std::string(optarg);
+            break;
+        case OPT_SPATIAL_INDEX :
+            conf.spatial_index = true;
+            break;
+        case OPT_STATS :
+            conf.stats = true;
+            if (optarg != NULL) stats_flag = std::string(optarg);
+            break;
+        case OPT_STATS_JSON :
+            conf.stats_json = std::string(optarg);
+            break;
         case 'h' :
             print_help();
             exit(EXIT_SUCCESS);
@@ -522,11 +3333,11 @@ int main (int argc, char **argv)
             exit(EXIT_FAILURE);
         }
     }
-    if (!fileExists(conf.input_file))
+    if (conf.input_file != "-" && !fileExists(conf.input_file))
     {
-        std::cout << "--- Error: Input file not found" << std::endl;
-        std::cout << "" << conf.input_file << std::endl;
-        std::cout << "Program stops unexpectedly" << std::endl;
+        std::cerr << "--- Error: Input file not found" << std::endl;
+        std::cerr << "" << conf.input_file << std::endl;
+        std::cerr << "Program stops unexpectedly" << std::endl;
         exit(EXIT_FAILURE);
     }
     if (mode == "xy") {
@@ -534,8 +3345,8 @@ int main (int argc, char **argv)
     } else if (mode == "wkt") {
         conf.mode_xy = false;
     } else {
-        std::cout << "--- Error -m should be either xy or wkt" << std::endl;
-        std::cout << "Program stops unexpectedly" << std::endl;
+        std::cerr << "--- Error -m should be either xy or wkt" << std::endl;
+        std::cerr << "Program stops unexpectedly" << std::endl;
         exit(EXIT_FAILURE);
     }
     if (header_flag == "t") {
@@ -543,25 +3354,91 @@ int main (int argc, char **argv)
     } else if (header_flag == "f") {
         conf.hasHeader = false;
     } else {
-        std::cout << "--- Error -H should be either t or f" << std::endl;
-        std::cout << "Program stops unexpectedly" << std::endl;
+        std::cerr << "--- Error -H should be either t or f" << std::endl;
+        std::cerr << "Program stops unexpectedly" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (writer_name == "gdal") {
+        conf.native_writer = false;
+    } else if (writer_name == "native") {
+        conf.native_writer = true;
+    } else {
+        std::cerr << "--- Error -w should be either gdal or native" << std::endl;
+        std::cerr << "Program stops unexpectedly" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (scan_flag == "all") {
+        conf.scan_rows = 0;
+    } else {
+        conf.scan_rows = atoll(scan_flag.c_str());
+        if (conf.scan_rows < 1) {
+            std::cerr << "--- Error -s should be all or a positive number" << std::endl;
+            std::cerr << "Program stops unexpectedly" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (!max_rows_flag.empty()) {
+        conf.max_rows = atoll(max_rows_flag.c_str());
+        if (conf.max_rows < 1) {
+            std::cerr << "--- Error --max-rows should be a positive number" << std::endl;
+            std::cerr << "Program stops unexpectedly" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (!max_bytes_flag.empty()) {
+        conf.max_bytes = parse_size(max_bytes_flag);
+        if (conf.max_bytes < 1024 || conf.max_bytes > SHAPEFILE_MAX_BYTES) {
+            std::cerr << "--- Error --max-bytes should be between 1K and 2G" << std::endl;
+            std::cerr << "Program stops unexpectedly" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        conf.max_bytes = std::min(conf.max_bytes, SHAPEFILE_MAX_BYTES);
+    }
+    if (sort_flag == "hilbert") {
+        conf.sort_hilbert = true;
+    } else if (!sort_flag.empty()) {
+        std::cerr << "--- Error --sort should be hilbert" << std::endl;
+        std::cerr << "Program stops unexpectedly" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!stats_flag.empty()) {
+        conf.progress_interval = atof(stats_flag.c_str());
+        if (conf.progress_interval <= 0) {
+            std::cerr << "--- Error --stats should be a positive number of seconds" << std::endl;
+            std::cerr << "Program stops unexpectedly" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (conf.threads < 1) {
+        std::cerr << "--- Error -j should be a positive number" << std::endl;
+        std::cerr << "Program stops unexpectedly" << std::endl;
         exit(EXIT_FAILURE);
     }
-    std::cout << "Read configuration finished" << std::endl;
+    std::cerr << "Read configuration finished" << std::endl;
     print_config(conf);
+    TickRate tick_rate;
     CSVReader reader(conf);
     std::vector<int> column_types = reader.get_column_types();
     std::vector<std::string> headers = reader.get_headers();
 
     int geom_type_idx = reader.get_geom_type_idx();
     SHPWriter writer(conf, reader);
-    int features = 0;
-    std::cout << "Write to file " << conf.output_file << std::endl;
-    while (reader.hasNextLine()) {
-        CSVRow row = reader.getNextLineAndSplitIntoTokens();
-        writer.write_data(row);
-        ++features;
+    double setup_seconds = tick_rate.seconds_since_start();
+    long long features = 0;
+    std::cerr << "Write to file " << conf.output_file << std::endl;
+    StageStats stage_stats;
+    Progress progress(conf.progress_interval);
+    Progress *reporter = conf.stats ? &progress : NULL;
+    if (conf.stats || !conf.stats_json.empty()) {
+        features = convert<StageTimer>(conf, reader, writer, stage_stats, reporter);
+    } else {
+        features = convert<NoTimer>(conf, reader, writer, stage_stats, NULL);
+    }
+    tick_rate.stop();
+    std::cerr << "Totally " << features << " features created" << std::endl;
+    if (conf.stats) print_stats(reader, features, stage_stats, tick_rate);
+    if (!conf.stats_json.empty()) {
+        write_stats_json(conf, reader, features, setup_seconds, stage_stats, tick_rate);
     }
-    std::cout << "Totally " << features << " features created" << std::endl;
-    std::cout << "---------------------------" << std::endl;
+    std::cerr << "---------------------------" << std::endl;
 }
@@ -0,0 +1,446 @@
+/**
+ *  RFC 4180 CSV scanner
+ *
+ *  Cells may be quoted, with the delimiter, line breaks and doubled quotes
+ *  inside quotes. The input is scanned 64 bytes at a time: a block is
+ *  compared with the delimiter, the quote and the line feed to get one bit
+ *  per byte for each, with SSE2 or AVX2 when available and SWAR otherwise.
+ *  The bits of the bytes inside quotes are the prefix XOR of the quote
+ *  bits, so the delimiters and line breaks outside quotes are found
+ *  without looking at the bytes one by one. A doubled quote toggles the
+ *  state twice and leaves it unchanged, so it needs no special case.
+ *
+ *  A carriage return before a line break is dropped. A trailing empty cell
+ *  is dropped, as when splitting with std::getline.
+ */
+#ifndef CSV2SHP_CSV_SCANNER_HPP
+#define CSV2SHP_CSV_SCANNER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * A cell of a CSV row, pointing into the buffer of the reader without copying.
+ * It is only valid until the next row is read.
+ */
+struct CSVCell {
+    const char *data;
+    size_t size;
+    bool empty() const {
+        return size == 0;
+    };
+    std::string str() const {
+        return std::string(data, size);
+    };
+    void copy_to(std::string &out) const {
+        out.assign(data, size);
+    };
+    bool operator==(const std::string &s) const {
+        return s.size() == size && memcmp(s.data(), data, size) == 0;
+    };
+};
+
+/**
+ * Cells of a row. The cells of quoted values with doubled quotes point
+ * into unescaped, the others into the line.
+ */
+struct CSVRow : public std::vector<CSVCell> {
+    std::vector<char> unescaped;
+    void clear() {
+        std::vector<CSVCell>::clear();
+        unescaped.clear();
+    };
+};
+
+class CSVScanner {
+public:
+    /**
+     * @param _quote quote character, 0 to read quotes as plain characters
+     */
+    CSVScanner(char _delimiter = ',', char _quote = '"'): delimiter(_delimiter), quote(_quote) {};
+    char get_delimiter() const {
+        return delimiter;
+    };
+    char get_quote() const {
+        return quote;
+    };
+    /**
+     * Find the first line feed outside quotes in [p, end).
+     * @param in_quote the quote state at p, updated to the state at end if
+     * no line feed is found so that the search can go on with more data
+     * @return the position of the line feed or NULL
+     */
+    const char *find_line_break(const char *p, const char *end, bool *in_quote) const {
+        if (quote == 0) return static_cast<const char *>(memchr(p, '\n', end - p));
+        uint64_t carry = *in_quote ? ~0ULL : 0;
+        for (; p < end; p += 64) {
+            size_t n = end - p < 64 ? end - p : 64;
+            Block block(p, n);
+            uint64_t inside = quote_mask(block, n, &carry);
+            uint64_t breaks = block.match('\n') & ~inside & valid_bits(n);
+            if (breaks != 0) return p + __builtin_ctzll(breaks);
+        }
+        *in_quote = carry != 0;
+        return NULL;
+    };
+    /**
+     * Get the range of the next line in [*pos, end) excluding the line break
+     * and move *pos to the start of the following line.
+     * @return false if there is no more line
+     */
+    bool next_line(const char **pos, const char *end, const char **line_begin, const char **line_end) const {
+        if (*pos >= end) return false;
+        bool in_quote = false;
+        const char *nl = find_line_break(*pos, end, &in_quote);
+        *line_begin = *pos;
+        *line_end = nl == NULL ? end : trim_cr(*pos, nl);
+        *pos = nl == NULL ? end : nl + 1;
+        return true;
+    };
+    /**
+     * Drop the carriage return before a line feed at line_end
+     */
+    static const char *trim_cr(const char *line_begin, const char *line_end) {
+        return line_end > line_begin && line_end[-1] == '\r' ? line_end - 1 : line_end;
+    };
+    /**
+     * Split a line into cells appended to row, removing the quotes of
+     * quoted cells.
+     */
+    void split_line(const char *line_begin, const char *line_end, CSVRow &row) const {
+        const char *cell = line_begin;
+        uint64_t carry = 0;
+        for (const char *p = line_begin; p < line_end; p += 64) {
+            size_t n = line_end - p < 64 ? line_end - p : 64;
+            Block block(p, n);
+            uint64_t inside = quote_mask(block, n, &carry);
+            uint64_t delimiters = block.match(delimiter) & valid_bits(n) & ~inside;
+            while (delimiters != 0) {
+                const char *d = p + __builtin_ctzll(delimiters);
+                add_cell(cell, d, row);
+                cell = d + 1;
+                delimiters &= delimiters - 1;
+            }
+        }
+        if (cell < line_end) add_cell(cell, line_end, row);
+    };
+    /**
+     * Split a range into chunks of about chunk_size bytes at line breaks.
+     * The quotes before a break are counted to know if it is inside quotes,
+     * so begin must be at the start of a line.
+     */
+    std::vector<std::pair<const char *, const char *> > split_range(const char *begin, const char *end, size_t chunk_size) const {
+        std::vector<std::pair<const char *, const char *> > chunks;
+        while (begin < end) {
+            const char *p = begin + std::min<size_t>(chunk_size, end - begin);
+            if (p < end) {
+                bool in_quote = (count_quotes(begin, p) & 1) != 0;
+                const char *nl = find_line_break(p, end, &in_quote);
+                p = nl == NULL ? end : nl + 1;
+            }
+            chunks.push_back(std::make_pair(begin, p));
+            begin = p;
+        }
+        return chunks;
+    };
+    /**
+     * Split a range into chunks of rows non-empty lines, blank lines are
+     * skipped by the writer and not counted.
+     */
+    std::vector<std::pair<const char *, const char *> > split_rows(const char *begin, const char *end, long long rows) const {
+        std::vector<std::pair<const char *, const char *> > chunks;
+        Cursor cursor(this, begin, end);
+        const char *line_begin;
+        const char *line_end;
+        long long count = 0;
+        while (cursor.next_line(&line_begin, &line_end)) {
+            if (line_end == line_begin) continue;
+            if (count == rows) {
+                chunks.push_back(std::make_pair(begin, line_begin));
+                begin = line_begin;
+                count = 0;
+            }
+            ++count;
+        }
+        if (count > 0) chunks.push_back(std::make_pair(begin, end));
+        return chunks;
+    };
+    /**
+     * Reads the lines or rows of a range in one pass: the delimiters and
+     * line feeds outside quotes of a block of 64 bytes are found at once
+     * and consumed by the following rows, instead of scanning each line
+     * twice. The range must start at the beginning of a line.
+     */
+    class Cursor {
+    public:
+        Cursor(): scanner(NULL), pos(NULL), end(NULL), block(NULL) {};
+        Cursor(const CSVScanner *_scanner, const char *begin, const char *_end):
+            scanner(_scanner), pos(begin), end(_end), block(begin) {
+            load_block();
+        };
+        /**
+         * Start of the next line
+         */
+        const char *position() const {
+            return pos;
+        };
+        /**
+         * Read the next line and split it into cells appended to row
+         * @return false if there is no more line
+         */
+        bool next_row(CSVRow &row, const char **line_begin, const char **line_end) {
+            if (pos >= end) return false;
+            const char *cell = pos;
+            *line_begin = pos;
+            // The state is copied to locals, which the writes to row cannot alias
+            uint64_t d = delimiters;
+            uint64_t b = breaks;
+            const char *base = block;
+            char q = scanner->quote;
+            while (true) {
+                uint64_t bits = d | b;
+                if (bits == 0) {
+                    if (next_block()) {
+                        d = delimiters;
+                        b = breaks;
+                        base = block;
+                        continue;
+                    }
+                    *line_end = end;
+                    if (cell < end) add_cell(cell, end, q, row);
+                    pos = end;
+                    return true;
+                }
+                uint64_t bit = bits & (0 - bits);
+                const char *p = base + __builtin_ctzll(bits);
+                if ((b & bit) != 0) {
+                    delimiters = d;
+                    breaks = b ^ bit;
+                    *line_end = trim_cr(*line_begin, p);
+                    if (cell < *line_end) add_cell(cell, *line_end, q, row);
+                    pos = p + 1;
+                    return true;
+                }
+                d ^= bit;
+                add_cell(cell, p, q, row);
+                cell = p + 1;
+            }
+        };
+        /**
+         * Read the next line without splitting it
+         * @return false if there is no more line
+         */
+        bool next_line(const char **line_begin, const char **line_end) {
+            if (pos >= end) return false;
+            *line_begin = pos;
+            while (breaks == 0) {
+                if (next_block()) continue;
+                *line_end = end;
+                pos = end;
+                return true;
+            }
+            uint64_t bit = breaks & (0 - breaks);
+            const char *p = block + __builtin_ctzll(breaks);
+            breaks ^= bit;
+            // The delimiters of the line are skipped
+            delimiters &= ~(bit | (bit - 1));
+            *line_end = trim_cr(*line_begin, p);
+            pos = p + 1;
+            return true;
+        };
+    private:
+        void add_cell(const char *begin, const char *end, char q, CSVRow &row) {
+            if (q == 0 || begin == end || *begin != q) {
+                row.push_back(CSVCell{begin, static_cast<size_t>(end - begin)});
+            } else {
+                scanner->add_quoted_cell(begin, end, row);
+            }
+        };
+        bool next_block() {
+            block += 64;
+            return load_block();
+        };
+        /**
+         * Find the delimiters and line feeds of the block
+         * @return false at the end of the range
+         */
+        bool load_block() {
+            delimiters = breaks = 0;
+            if (block >= end) return false;
+            size_t n = end - block < 64 ? end - block : 64;
+            Block data(block, n);
+            uint64_t inside = scanner->quote_mask(data, n, &carry);
+            uint64_t valid = valid_bits(n) & ~inside;
+            delimiters = data.match(scanner->delimiter) & valid;
+            breaks = data.match('\n') & valid;
+            return true;
+        };
+        const CSVScanner *scanner;
+        const char *pos; // start of the next line
+        const char *end;
+        const char *block; // block of the bits
+        uint64_t delimiters = 0; // delimiters and line feeds not consumed yet
+        uint64_t breaks = 0;
+        uint64_t carry = 0; // all bits set if the block ends inside quotes
+    };
+    /**
+     * Number of quote characters in [p, end)
+     */
+    uint64_t count_quotes(const char *p, const char *end) const {
+        if (quote == 0) return 0;
+        uint64_t count = 0;
+        for (; p < end; p += 64) {
+            size_t n = end - p < 64 ? end - p : 64;
+            count += __builtin_popcountll(Block(p, n).match(quote) & valid_bits(n));
+        }
+        return count;
+    };
+private:
+    /**
+     * 64 bytes of input. At the end of the data the bytes after it are
+     * read too, or copied to a buffer if they are in another memory page,
+     * and their bits must be ignored.
+     */
+    class Block {
+    public:
+        Block(const char *p, size_t n) {
+            // Reading past the data is safe within its memory page
+            if (n < 64 && (reinterpret_cast<uintptr_t>(p) & 4095) > 4096 - 64) {
+                memcpy(tail, p, n);
+                p = tail;
+            }
+#if defined(__AVX2__)
+            v[0] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+            v[1] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32));
+#elif defined(__SSE2__)
+            for (int i = 0; i < 4; ++i) v[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * i));
+#else
+            memcpy(words, p, 64);
+#endif
+        };
+        /**
+         * Bit i is set if byte i is c
+         */
+        uint64_t match(char c) const {
+#if defined(__AVX2__)
+            __m256i needle = _mm256_set1_epi8(c);
+            uint64_t lo = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v[0], needle)));
+            uint64_t hi = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v[1], needle)));
+            return lo | (hi << 32);
+#elif defined(__SSE2__)
+            __m128i needle = _mm_set1_epi8(c);
+            uint64_t bits = 0;
+            for (int i = 0; i < 4; ++i) {
+                bits |= static_cast<uint64_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], needle))) << (16 * i);
+            }
+            return bits;
+#else
+            const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+            uint64_t needle = 0x0101010101010101ULL * static_cast<unsigned char>(c);
+            uint64_t bits = 0;
+            for (int i = 0; i < 8; ++i) {
+                uint64_t x = words[i] ^ needle;
+                // High bit of each byte set if the byte is zero, without carries between bytes
+                uint64_t zero = ~(((x & low7) + low7) | x | low7);
+                bits |= ((zero >> 7) * 0x0102040810204080ULL >> 56) << (8 * i);
+            }
+            return bits;
+#endif
+        };
+    private:
+#if defined(__AVX2__)
+        __m256i v[2];
+#elif defined(__SSE2__)
+        __m128i v[4];
+#else
+        uint64_t words[8]; // little endian
+#endif
+        char tail[64];
+    };
+    /**
+     * Bit i is the XOR of bits 0 to i: set for the bytes after an odd
+     * number of quotes, including the opening quote
+     */
+    static uint64_t prefix_xor(uint64_t x) {
+        x ^= x << 1;
+        x ^= x << 2;
+        x ^= x << 4;
+        x ^= x << 8;
+        x ^= x << 16;
+        x ^= x << 32;
+        return x;
+    };
+    /**
+     * Bits of the bytes of a block inside quotes, carry is set to all ones
+     * if the block ends inside quotes.
+     */
+    uint64_t quote_mask(const Block &block, size_t n, uint64_t *carry) const {
+        if (quote == 0) return 0;
+        uint64_t quotes = block.match(quote) & valid_bits(n);
+        if (quotes == 0) return *carry;
+        uint64_t inside = prefix_xor(quotes) ^ *carry;
+        *carry = static_cast<uint64_t>(static_cast<int64_t>(inside) >> 63);
+        return inside;
+    };
+    static uint64_t valid_bits(size_t n) {
+        return n >= 64 ? ~0ULL : (1ULL << n) - 1;
+    };
+    /**
+     * Add the cell [begin, end) to row. A quoted cell is the text between
+     * its first and last quote, with doubled quotes unescaped.
+     */
+    void add_cell(const char *begin, const char *end, CSVRow &row) const {
+        if (quote == 0 || begin == end || *begin != quote) {
+            row.push_back(CSVCell{begin, static_cast<size_t>(end - begin)});
+            return;
+        }
+        add_quoted_cell(begin, end, row);
+    };
+    void add_quoted_cell(const char *begin, const char *end, CSVRow &row) const {
+        ++begin;
+        if (end > begin && end[-1] == quote) --end;
+        const char *q = static_cast<const char *>(memchr(begin, quote, end - begin));
+        if (q == NULL) {
+            row.push_back(CSVCell{begin, static_cast<size_t>(end - begin)});
+            return;
+        }
+        // The unescaped text must not move while the row is in use
+        if (row.unescaped.capacity() - row.unescaped.size() < static_cast<size_t>(end - begin)) {
+            relocate_unescaped(row, end - begin);
+        }
+        size_t offset = row.unescaped.size();
+        for (const char *p = begin; p < end; ++p) {
+            row.unescaped.push_back(*p);
+            if (*p == quote && p + 1 < end && p[1] == quote) ++p;
+        }
+        row.push_back(CSVCell{row.unescaped.data() + offset, row.unescaped.size() - offset});
+    };
+    /**
+     * Grow the unescaped text of a row and move the cells pointing into it
+     */
+    static void relocate_unescaped(CSVRow &row, size_t extra) {
+        const char *old_begin = row.unescaped.data();
+        const char *old_end = old_begin + row.unescaped.size();
+        std::vector<char> grown;
+        grown.reserve(2 * (row.unescaped.size() + extra));
+        grown.assign(row.unescaped.begin(), row.unescaped.end());
+        for (size_t i = 0; i < row.size(); ++i) {
+            if (row[i].data >= old_begin && row[i].data < old_end) {
+                row[i].data = grown.data() + (row[i].data - old_begin);
+            }
+        }
+        row.unescaped.swap(grown);
+    };
+    char delimiter;
+    char quote;
+};
+
+#endif // CSV2SHP_CSV_SCANNER_HPP
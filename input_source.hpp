@@ -0,0 +1,286 @@
+/**
+ *  Sequential input sources used when the CSV file cannot be memory mapped
+ *
+ *  A source reads from a file descriptor (a pipe, stdin or a regular file)
+ *  and can decompress gzip or, when built with CSV2SHP_WITH_ZSTD, zstd
+ *  input. ThreadedSource runs a source on its own thread and hands over its
+ *  output through a bounded number of blocks, so that decompression and
+ *  parsing overlap while the memory used stays constant. Errors are
+ *  reported by read() returning -1, with a message from get_error().
+ */
+#ifndef CSV2SHP_INPUT_SOURCE_HPP
+#define CSV2SHP_INPUT_SOURCE_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef CSV2SHP_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+class InputSource {
+public:
+    virtual ~InputSource() {};
+    /**
+     * Read at most size bytes into buf.
+     * @return number of bytes read, 0 at the end of the input or -1 on error
+     */
+    virtual ssize_t read(char *buf, size_t size) = 0;
+    const std::string &get_error() const {
+        return error;
+    };
+protected:
+    std::string error;
+};
+
+/**
+ * Reads a file descriptor, after the bytes already consumed from it to
+ * detect the compression.
+ */
+class FileSource : public InputSource {
+public:
+    FileSource(int _fd, const std::string &_prefix): fd(_fd), prefix(_prefix) {};
+    ssize_t read(char *buf, size_t size) {
+        if (prefix_pos < prefix.size()) {
+            size_t n = std::min(size, prefix.size() - prefix_pos);
+            memcpy(buf, prefix.data() + prefix_pos, n);
+            prefix_pos += n;
+            return n;
+        }
+        ssize_t n;
+        do {
+            n = ::read(fd, buf, size);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) error = strerror(errno);
+        return n;
+    };
+private:
+    int fd;
+    std::string prefix;
+    size_t prefix_pos = 0;
+};
+
+/**
+ * Decompresses gzip input, including files made of several gzip members
+ * such as the output of concatenated gzip runs.
+ */
+class GzipSource : public InputSource {
+public:
+    GzipSource(InputSource *_input): input(_input), in(1 << 18) {
+        memset(&stream, 0, sizeof(stream));
+        // 15 + 16 accepts the gzip format only
+        if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+            error = "cannot initialize zlib";
+            failed = true;
+        }
+    };
+    ~GzipSource() {
+        inflateEnd(&stream);
+        delete input;
+    };
+    ssize_t read(char *buf, size_t size) {
+        if (failed) return -1;
+        stream.next_out = reinterpret_cast<Bytef *>(buf);
+        stream.avail_out = size;
+        while (stream.avail_out == size) {
+            if (stream.avail_in == 0) {
+                if (input_end) break;
+                ssize_t n = input->read(in.data(), in.size());
+                if (n < 0) return fail(input->get_error());
+                if (n == 0) {
+                    input_end = true;
+                    if (!member_end) return fail("truncated gzip input");
+                    break;
+                }
+                stream.next_in = reinterpret_cast<Bytef *>(in.data());
+                stream.avail_in = n;
+            }
+            if (member_end) {
+                // Another gzip member follows
+                inflateReset(&stream);
+                member_end = false;
+            }
+            int ret = inflate(&stream, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                member_end = true;
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                return fail(stream.msg != NULL ? stream.msg : "invalid gzip data");
+            }
+        }
+        return size - stream.avail_out;
+    };
+private:
+    ssize_t fail(const std::string &message) {
+        error = message;
+        failed = true;
+        return -1;
+    };
+    InputSource *input;
+    std::vector<char> in;
+    z_stream stream;
+    bool member_end = false;
+    bool input_end = false;
+    bool failed = false;
+};
+
+#ifdef CSV2SHP_WITH_ZSTD
+/**
+ * Decompresses zstd input, including several concatenated frames.
+ */
+class ZstdSource : public InputSource {
+public:
+    ZstdSource(InputSource *_input): input(_input), in(ZSTD_DStreamInSize()) {
+        stream = ZSTD_createDStream();
+        ZSTD_initDStream(stream);
+        in_buf.src = in.data();
+        in_buf.size = in_buf.pos = 0;
+    };
+    ~ZstdSource() {
+        ZSTD_freeDStream(stream);
+        delete input;
+    };
+    ssize_t read(char *buf, size_t size) {
+        if (failed) return -1;
+        ZSTD_outBuffer out_buf = {buf, size, 0};
+        while (out_buf.pos == 0) {
+            if (in_buf.pos == in_buf.size) {
+                ssize_t n = input->read(in.data(), in.size());
+                if (n < 0) return fail(input->get_error());
+                if (n == 0) {
+                    if (frame_remaining != 0) return fail("truncated zstd input");
+                    break;
+                }
+                in_buf.size = n;
+                in_buf.pos = 0;
+            }
+            frame_remaining = ZSTD_decompressStream(stream, &out_buf, &in_buf);
+            if (ZSTD_isError(frame_remaining)) return fail(ZSTD_getErrorName(frame_remaining));
+        }
+        return out_buf.pos;
+    };
+private:
+    ssize_t fail(const std::string &message) {
+        error = message;
+        failed = true;
+        return -1;
+    };
+    InputSource *input;
+    std::vector<char> in;
+    ZSTD_DStream *stream;
+    ZSTD_inBuffer in_buf;
+    size_t frame_remaining = 0;
+    bool failed = false;
+};
+#endif
+
+/**
+ * Runs a source on a background thread. The thread fills at most
+ * max_blocks blocks ahead of the reader and waits when they are all full.
+ */
+class ThreadedSource : public InputSource {
+public:
+    ThreadedSource(InputSource *_input, size_t _block_size = 1 << 20, size_t _max_blocks = 4):
+        input(_input), block_size(_block_size), max_blocks(_max_blocks) {
+        worker = std::thread(&ThreadedSource::produce, this);
+    };
+    ~ThreadedSource() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopped = true;
+        }
+        not_full.notify_all();
+        worker.join();
+        delete input;
+    };
+    ssize_t read(char *buf, size_t size) {
+        if (current_pos == current.size()) {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_empty.wait(lock, [this]() { return !blocks.empty() || finished; });
+            if (blocks.empty()) {
+                if (failed) error = input->get_error();
+                return failed ? -1 : 0;
+            }
+            // The previous block is given back to the producer to be reused
+            std::swap(current, blocks.front());
+            free_blocks.push_back(std::vector<char>());
+            std::swap(free_blocks.back(), blocks.front());
+            blocks.pop_front();
+            current_pos = 0;
+            not_full.notify_one();
+        }
+        size_t n = std::min(size, current.size() - current_pos);
+        memcpy(buf, current.data() + current_pos, n);
+        current_pos += n;
+        return n;
+    };
+private:
+    void produce() {
+        while (true) {
+            std::vector<char> block;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                not_full.wait(lock, [this]() { return blocks.size() < max_blocks || stopped; });
+                if (stopped) return;
+                if (!free_blocks.empty()) {
+                    block.swap(free_blocks.back());
+                    free_blocks.pop_back();
+                }
+            }
+            block.resize(block_size);
+            size_t filled = 0;
+            ssize_t n = 0;
+            while (filled < block_size && (n = input->read(block.data() + filled, block_size - filled)) > 0) {
+                filled += n;
+            }
+            block.resize(filled);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (filled > 0) blocks.push_back(std::move(block));
+            if (n <= 0) {
+                failed = n < 0;
+                finished = true;
+                not_empty.notify_one();
+                return;
+            }
+            not_empty.notify_one();
+        }
+    };
+    InputSource *input;
+    size_t block_size;
+    size_t max_blocks;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<std::vector<char> > blocks; // filled blocks waiting to be read
+    std::vector<std::vector<char> > free_blocks;
+    std::vector<char> current; // block being read
+    size_t current_pos = 0;
+    bool finished = false;
+    bool failed = false;
+    bool stopped = false;
+};
+
+/**
+ * Compression of a stream detected from its first bytes
+ */
+enum InputCompression {
+    INPUT_PLAIN = 0,
+    INPUT_GZIP = 1,
+    INPUT_ZSTD = 2
+};
+
+inline InputCompression detect_compression(const char *magic, size_t size) {
+    if (size >= 2 && (unsigned char) magic[0] == 0x1f && (unsigned char) magic[1] == 0x8b) return INPUT_GZIP;
+    if (size >= 4 && (unsigned char) magic[0] == 0x28 && (unsigned char) magic[1] == 0xb5 &&
+        (unsigned char) magic[2] == 0x2f && (unsigned char) magic[3] == 0xfd) return INPUT_ZSTD;
+    return INPUT_PLAIN;
+};
+
+#endif // CSV2SHP_INPUT_SOURCE_HPP
@@ -0,0 +1,190 @@
+/**
+ *  Time and count of the stages of a conversion
+ *
+ *  The conversion code takes the timer as a template parameter. It is
+ *  instantiated with NoTimer when statistics are disabled, so the timing
+ *  calls compile to nothing, and with StageTimer otherwise. StageTimer
+ *  works like the lap button of a stopwatch: lap(stage) adds the time
+ *  since the previous lap to the stage, so consecutive stages are covered
+ *  without gaps with a single clock read each. Each thread has its own
+ *  StageStats, merged at the end. Progress prints periodic progress lines
+ *  on stderr.
+ */
+#ifndef CSV2SHP_STAGE_STATS_HPP
+#define CSV2SHP_STAGE_STATS_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <mutex>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+enum Stage {
+    STAGE_READ = 0, // finding the next line, including reading the input
+    STAGE_SPLIT = 1, // splitting a line into cells
+    STAGE_NUMERIC_PARSE = 2, // converting the attribute cells and coordinates
+    STAGE_WKT_PARSE = 3, // parsing a WKT geometry
+    STAGE_BUILD_FEATURE = 4, // creating the OGR feature and geometry, or the native records
+    STAGE_CREATE_FEATURE = 5, // writing the features to the layer or the native files
+    STAGE_FLUSH = 6, // closing the output files
+    NUM_STAGES = 7
+};
+
+static const char *const STAGE_NAMES[NUM_STAGES] = {
+    "read", "split", "numeric_parse", "wkt_parse", "build_feature", "create_feature", "flush"
+};
+
+/**
+ * Cheap clock in ticks: the time stamp counter on x86, nanoseconds
+ * elsewhere. Ticks are converted to seconds with a rate measured over the
+ * run.
+ */
+class TickClock {
+public:
+    static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return wall_ns();
+#endif
+    };
+    static uint64_t wall_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    };
+};
+
+struct StageStats {
+    uint64_t ticks[NUM_STAGES] = {0, 0, 0, 0, 0, 0, 0};
+    uint64_t counts[NUM_STAGES] = {0, 0, 0, 0, 0, 0, 0};
+    void merge(const StageStats &other) {
+        for (int i = 0; i < NUM_STAGES; ++i) {
+            ticks[i] += other.ticks[i];
+            counts[i] += other.counts[i];
+        }
+    };
+};
+
+/**
+ * Timer used when statistics are disabled
+ */
+struct NoTimer {
+    explicit NoTimer(StageStats *) {};
+    void start() {};
+    void lap(Stage, uint64_t = 1) {};
+};
+
+struct StageTimer {
+    explicit StageTimer(StageStats *_stats): stats(_stats) {
+        start();
+    };
+    void start() {
+        last = TickClock::now();
+    };
+    /**
+     * Add the time since the last lap to a stage, count is the number of
+     * items processed by the stage, such as features written.
+     */
+    void lap(Stage stage, uint64_t count = 1) {
+        uint64_t now = TickClock::now();
+        stats->ticks[stage] += now - last;
+        stats->counts[stage] += count;
+        last = now;
+    };
+    StageStats *stats;
+    uint64_t last;
+};
+
+/**
+ * Converts ticks to seconds with the rate measured between construction
+ * and the call to stop().
+ */
+class TickRate {
+public:
+    TickRate(): start_ticks(TickClock::now()), start_ns(TickClock::wall_ns()) {};
+    void stop() {
+        uint64_t ticks = TickClock::now() - start_ticks;
+        uint64_t ns = TickClock::wall_ns() - start_ns;
+        elapsed = ns / 1e9;
+        ticks_per_second = ns > 0 && ticks > 0 ? ticks / elapsed : 1e9;
+    };
+    double seconds_since_start() const {
+        return (TickClock::wall_ns() - start_ns) / 1e9;
+    };
+    double seconds(uint64_t ticks) const {
+        return ticks / ticks_per_second;
+    };
+    /**
+     * Wall time between construction and stop()
+     */
+    double elapsed_seconds() const {
+        return elapsed;
+    };
+private:
+    uint64_t start_ticks;
+    uint64_t start_ns;
+    double ticks_per_second = 1e9;
+    double elapsed = 0;
+};
+
+/**
+ * Prints a progress line on stderr at most once per interval. report() is
+ * cheap when the interval has not elapsed and can be called from several
+ * threads. The ETA is extrapolated from the fraction done since the start
+ * of the current phase.
+ */
+class Progress {
+public:
+    explicit Progress(double interval): interval_ns(static_cast<uint64_t>(interval * 1e9)) {
+        start_phase();
+    };
+    /**
+     * Start a new phase of the work, such as writing the rows after
+     * sorting them, whose fraction starts again from 0 and whose rates
+     * are computed from the given rows and bytes.
+     */
+    void start_phase(long long rows = 0, long long bytes = 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        last_rows = rows;
+        last_bytes = bytes;
+        phase_ns = last_ns = TickClock::wall_ns();
+        next_ns = phase_ns + interval_ns;
+    };
+    /**
+     * @param rows number of rows done
+     * @param bytes number of input bytes processed
+     * @param fraction fraction of the phase done, negative if unknown
+     */
+    void report(long long rows, long long bytes, double fraction) {
+        uint64_t now = TickClock::wall_ns();
+        if (now < next_ns.load(std::memory_order_relaxed)) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (now < next_ns.load(std::memory_order_relaxed)) return;
+        double seconds = (now - last_ns) / 1e9;
+        char eta[64] = "";
+        if (fraction > 0 && fraction < 1) {
+            long long remaining = static_cast<long long>((now - phase_ns) / 1e9 * (1 - fraction) / fraction);
+            snprintf(eta, sizeof(eta), ", %.1f%%, ETA %lld:%02lld:%02lld", fraction * 100,
+                     remaining / 3600, remaining / 60 % 60, remaining % 60);
+        }
+        fprintf(stderr, "Progress: %lld rows, %.1f MB, %.0f rows/s, %.1f MB/s%s\n", rows, bytes / 1048576.0,
+                (rows - last_rows) / seconds, (bytes - last_bytes) / seconds / 1048576.0, eta);
+        last_ns = now;
+        last_rows = rows;
+        last_bytes = bytes;
+        next_ns = now + interval_ns;
+    };
+private:
+    uint64_t interval_ns;
+    uint64_t phase_ns;
+    uint64_t last_ns;
+    long long last_rows;
+    long long last_bytes;
+    std::atomic<uint64_t> next_ns; // time of the next line
+    std::mutex mutex;
+};
+
+#endif // CSV2SHP_STAGE_STATS_HPP